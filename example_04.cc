@@ -0,0 +1,45 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include <memstats.hh>
+
+// Cost of the instrumented new/delete: one thread alone (uncontended), then all of them at once (contended).
+// Usage: example_04 [threads] [iterations per thread]
+
+double run(int threads, int iterations, bool instrument)
+{
+    std::vector<std::thread> workers;
+    const auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t != threads; ++t) {
+        workers.emplace_back([=]{
+            if (instrument)
+                memstats_enable_thread_instrumentation();
+            char * volatile do_not_optimize;
+            for (int i = 0; i != iterations; ++i) {
+                do_not_optimize = new char[32];
+                delete[] do_not_optimize;
+            }
+            if (instrument)
+                memstats_disable_thread_instrumentation();
+        });
+    }
+    for (auto& worker : workers)
+        worker.join();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char ** argv)
+{
+    const int threads = argc > 1 ? std::atoi(argv[1]) : 8;
+    const int iterations = argc > 2 ? std::atoi(argv[2]) : 500000;
+    for (int n : {1, threads}) {
+        const double off = run(n, iterations, false);
+        const double on = run(n, iterations, true);
+        std::printf("%2d thread(s) x %d new/delete: %.3f s not instrumented, %.3f s instrumented, %.1f ns per pair\n",
+                    n, iterations, off, on, 1e9 * on / (double(n) * iterations));
+    }
+    memstats_report("benchmark");
+}
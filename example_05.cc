@@ -0,0 +1,24 @@
+#include <memstats.hh>
+
+// Run with MEMSTATS_TRACE_FILE=<path>, then 'memstats_analyze <path>' prints the same reports.
+
+char * volatile do_not_optimize;
+
+void allocate(int count, int size)
+{
+    memstats_enable_thread_instrumentation();
+    for (int i = 0; i != count; ++i) {
+        do_not_optimize = new char[size];
+        delete[] do_not_optimize;
+    }
+    memstats_disable_thread_instrumentation();
+}
+
+int main()
+{
+    // 250kB (of 1024 bytes) in 1k allocations of 256 bytes
+    allocate(1000, 256);
+    memstats_report("first");
+    // 125kB in 2k allocations of 64 bytes, reported at exit
+    allocate(2000, 64);
+}
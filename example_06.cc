@@ -0,0 +1,46 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <memstats.hh>
+
+thread_local volatile void * do_not_optimize;
+
+// Reports made by a thread while the other threads keep allocating, starting and finishing.
+
+int main()
+{
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+    for (int rep = 1; rep != 5; ++rep) {
+        threads.emplace_back([&, rep]{
+            memstats_enable_thread_instrumentation();
+            for (int round = 0; round != 4 * rep; ++round) {
+                // short-lived threads that finish while reports are being made
+                std::thread([]{
+                    memstats_enable_thread_instrumentation();
+                    for (int i = 0; i != 1000; ++i) {
+                        std::vector<char> v(i + 1);
+                        do_not_optimize = v.data();
+                    }
+                    memstats_disable_thread_instrumentation();
+                }).join();
+                for (int i = 0; i != 10000; ++i) {
+                    std::vector<double> v(rep * 10);
+                    do_not_optimize = v.data();
+                }
+            }
+            memstats_disable_thread_instrumentation();
+        });
+    }
+    std::thread reporter([&]{
+        for (int rep = 1; not done.load(); ++rep)
+            memstats_report(("concurrent " + std::to_string(rep)).c_str());
+    });
+    for(auto& thread : threads)
+        thread.join();
+    done = true;
+    reporter.join();
+    memstats_report("joined");
+}
@@ -0,0 +1,33 @@
+#include <memstats.hh>
+
+// Allocations attributed to nested regions: "parse" includes "parse/lex", and "solve" is apart.
+
+char * volatile do_not_optimize;
+
+void allocate(int count, int size)
+{
+    for (int i = 0; i != count; ++i) {
+        do_not_optimize = new char[size];
+        delete[] do_not_optimize;
+    }
+}
+
+int main()
+{
+    memstats_enable_thread_instrumentation();
+    {
+        MemStatsRegion parse{"parse"};
+        // 1k allocations of 64 bytes in "parse"
+        allocate(1000, 64);
+        {
+            MemStatsRegion lex{"lex"};
+            // 2k allocations of 64 bytes in "parse/lex", and rolled up into "parse"
+            allocate(2000, 64);
+        }
+    }
+    memstats_region_begin("solve");
+    // 4k allocations of 256 bytes in "solve"
+    allocate(4000, 256);
+    memstats_region_end();
+    memstats_disable_thread_instrumentation();
+}
@@ -0,0 +1,30 @@
+#include <cstdio>
+
+#include <memstats.hh>
+
+// No-alloc scopes count the allocations made within them, whether instrumentation is enabled or not.
+
+char * volatile do_not_optimize;
+
+int main()
+{
+    {
+        // no allocations within the scope
+        MemStatsNoAlloc scope{"clean"};
+        do_not_optimize = nullptr;
+    }
+    memstats_noalloc_begin("outer");
+    memstats_noalloc_begin("inner");
+    do_not_optimize = new char[16];
+    delete[] do_not_optimize;
+    const size_t inner = memstats_noalloc_end();
+    do_not_optimize = new char[32];
+    delete[] do_not_optimize;
+    const size_t outer = memstats_noalloc_end();
+    // the allocation of the inner scope is also counted by the outer one
+    if (inner != 1 or outer != 2) {
+        std::printf("unexpected allocations within no-alloc scopes: %zu in 'inner', %zu in 'outer'\n", inner, outer);
+        return 1;
+    }
+    memstats_report("no-alloc");
+}
@@ -0,0 +1,68 @@
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include <memstats.hh>
+
+// Allocation counters polled by a monitoring thread while other threads allocate and finish.
+
+thread_local char * volatile do_not_optimize;
+
+struct Totals
+{
+    unsigned long long allocations = 0;
+    unsigned long long allocated_bytes = 0;
+    unsigned long long size_class = 0;
+};
+
+void add(const memstats_counters * counters, void * data)
+{
+    auto& totals = *static_cast<Totals *>(data);
+    totals.allocations += counters->allocations;
+    totals.allocated_bytes += counters->allocated_bytes;
+    // sizes in [64, 128)
+    totals.size_class += counters->size_classes[6];
+}
+
+int main()
+{
+    const int count = 4, iterations = 10000;
+    std::atomic<bool> done{false};
+    std::thread monitor([&]{
+        // a thread exiting during a poll may be counted twice by that poll
+        unsigned long long last = 0;
+        while (not done.load()) {
+            Totals totals;
+            memstats_thread_counters(add, &totals);
+            if (totals.allocations != last)
+                std::printf("%llu allocations, %llu bytes\n", totals.allocations, totals.allocated_bytes);
+            last = totals.allocations;
+        }
+    });
+    std::vector<std::thread> threads;
+    for (int rep = 0; rep != count; ++rep) {
+        threads.emplace_back([=]{
+            memstats_enable_thread_instrumentation();
+            for (int i = 0; i != iterations; ++i) {
+                do_not_optimize = new char[100];
+                delete[] do_not_optimize;
+            }
+            memstats_disable_thread_instrumentation();
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+    done = true;
+    monitor.join();
+
+    // the counters of the finished threads are summed up into a single entry
+    Totals totals;
+    memstats_thread_counters(add, &totals);
+    std::printf("%llu allocations, %llu bytes\n", totals.allocations, totals.allocated_bytes);
+    const unsigned long long expected = count * iterations;
+    if (totals.allocations != expected or totals.allocated_bytes != 100 * expected or totals.size_class != expected) {
+        std::printf("expected %llu allocations of 100 bytes\n", expected);
+        return 1;
+    }
+}
@@ -1,22 +1,66 @@
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
 #include <mutex>
 #include <new>
 #include <sstream>
 #include <tuple>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 
+#if MEMSTAT_PRELOAD
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// trace files are memory-mapped where available, otherwise they are read into memory
+#if defined(__unix__) || defined(__APPLE__)
+#define MEMSTATS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// raw time-stamp counters for the 'tsc' clock
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define MEMSTATS_HAVE_TSC 1
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define MEMSTATS_HAVE_TSC 1
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+#define MEMSTATS_HAVE_TSC 1
+#endif
+
+// process-wide memory barriers, so that recording threads do not execute a full barrier on every event
+#if defined(__linux__) && __has_include(<linux/membarrier.h>)
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define MEMSTATS_HAVE_MEMBARRIER 1
+#endif
+
 #if __has_include(<version>)
 #include <version>
 #endif
@@ -26,7 +70,19 @@
 #endif
 
 #if MEMSTAT_HAVE_TBB
-#include <oneapi/tbb/concurrent_vector.h>
+#include <tbb/parallel_for.h>
+#endif
+
+// raw return addresses of recorded stacktraces are collected with the unwinder of the C++ runtime where available
+#if MEMSTAT_HAVE_STACKTRACE && (defined(__GNUC__) || defined(__clang__)) && !defined(_WIN32) && __has_include(<unwind.h>)
+#include <unwind.h>
+#define MEMSTATS_HAVE_UNWIND 1
+#endif
+
+// 'std::stacktrace_entry' of libstdc++ 12 to 15 holds nothing but the address of its frame, from which entries are made without
+// unwinding a second time. This relies on the private layout of the class, other libraries get their entries from 'stacktrace::current'.
+#if MEMSTATS_HAVE_UNWIND && defined(__GLIBCXX__) && defined(_GLIBCXX_RELEASE) && _GLIBCXX_RELEASE >= 12 && _GLIBCXX_RELEASE <= 15
+#define MEMSTATS_HAVE_STACKTRACE_ENTRY_LAYOUT 1
 #endif
 
 #if __cpp_constinit >= 201907L
@@ -35,8 +91,43 @@
 #define MEMSTATS_CONSTINIT
 #endif
 
+// functions whose frames are skipped on recorded stacktraces must not be inlined
+#if defined(_MSC_VER)
+#define MEMSTATS_NOINLINE __declspec(noinline)
+#elif defined(__GNUC__) || defined(__clang__)
+#define MEMSTATS_NOINLINE __attribute__((noinline))
+#else
+#define MEMSTATS_NOINLINE
+#endif
+
+// symbols that have to be visible when built as a shared library
+#if defined(__GNUC__) || defined(__clang__)
+#define MEMSTATS_EXPORT __attribute__((visibility("default")))
+#else
+#define MEMSTATS_EXPORT
+#endif
+
 #include "memstats.hh"
 
+#if MEMSTAT_PRELOAD
+// When preloaded, 'malloc' and friends are interposed by this library, so the allocations of the library itself go
+// straight to the glibc implementation. Otherwise they would be instrumented (and would recurse into the instrumentation).
+extern "C"
+{
+void *__libc_malloc(std::size_t);
+void *__libc_calloc(std::size_t, std::size_t);
+void *__libc_realloc(void *, std::size_t);
+void *__libc_memalign(std::size_t, std::size_t);
+void __libc_free(void *);
+}
+
+inline void *memstats_raw_malloc(std::size_t sz) { return __libc_malloc(sz); }
+inline void memstats_raw_free(void *ptr) { __libc_free(ptr); }
+#else
+inline void *memstats_raw_malloc(std::size_t sz) { return std::malloc(sz); }
+inline void memstats_raw_free(void *ptr) { std::free(ptr); }
+#endif
+
 // all allocations within this library need to use malloc/free instad of new/delete
 template <class T>
 class MallocAllocator
@@ -54,7 +145,7 @@ public:
         if (n > this->max_size())
             throw std::bad_alloc();
 
-        T *ret = static_cast<T *>(std::malloc(n * sizeof(T)));
+        T *ret = static_cast<T *>(memstats_raw_malloc(n * sizeof(T)));
         if (!ret)
             throw std::bad_alloc();
         return ret;
@@ -62,7 +153,7 @@ public:
 
     void deallocate(T *p, std::size_t)
     {
-        std::free(p);
+        memstats_raw_free(p);
     }
 
     std::size_t max_size() const noexcept
@@ -78,376 +169,4355 @@ public:
     }
 };
 
-struct MemStatsInfo
-{
-    const void *ptr = nullptr;
-    std::size_t size = 0;
-    std::chrono::high_resolution_clock::time_point time = {};
-    std::thread::id thread = {};
+template <class T>
+using vector = std::vector<T, MallocAllocator<T>>;
+template <class Key>
+using unordered_set = std::unordered_set<Key, std::hash<Key>, std::equal_to<Key>, MallocAllocator<Key>>;
+template <class Key, class T>
+using unordered_map = std::unordered_map<Key, T, std::hash<Key>, std::equal_to<Key>, MallocAllocator<std::pair<const Key, T>>>;
+using string = std::basic_string<char, std::char_traits<char>, MallocAllocator<char>>;
+using stringstream = std::basic_stringstream<char, std::char_traits<char>, MallocAllocator<char>>;
 #if MEMSTAT_HAVE_STACKTRACE
-    std::basic_stacktrace<MallocAllocator<std::stacktrace_entry>> stacktrace;
+using stacktrace = std::basic_stacktrace<MallocAllocator<std::stacktrace_entry>>;
 #endif
 
-    static void record(void *ptr, std::size_t sz = 0);
-};
-
-bool init_memstats_instrumentation_thread()
+// floor(log2(value)) for a non-zero value
+inline unsigned memstats_log2(std::size_t value)
 {
-    if (char *ptr = std::getenv("MEMSTATS_THREAD_INSTRUMENTATION_INIT"))
-    {
-        if (std::strcmp(ptr, "true") == 0 or std::strcmp(ptr, "1") == 0)
-            return true;
-        if (std::strcmp(ptr, "false") == 0 or std::strcmp(ptr, "0") == 0)
-            return false;
-        std::cerr << "Option 'MEMSTATS_THREAD_INSTRUMENTATION_INIT=" << ptr << "' not known. Fallback on default 'false'\n";
-    }
-    return false;
+#if defined(__GNUC__) || defined(__clang__)
+    return std::numeric_limits<unsigned long long>::digits - 1 - __builtin_clzll(value);
+#else
+    unsigned log = 0;
+    while (value >>= 1)
+        ++log;
+    return log;
+#endif
 }
 
-/** NOTE: initialization order fiasco on the sight!
- * The operator 'new' and 'delete' are automatically exposed to the whole program and
- * dynamic-initializtion of other global variables may be interleaved with the ones defined here.
- * This means that another translation unit may try to use 'new' or 'delete' during its static
- * initialization/destruction phase and may end up triggering an undefined behavior on this one.
- * Therefore, we need to reason about the order of initialization of global variables here with
- * respect to global variables in other libraries. Three key points help us to get this right:
- * (i) 'new'/'delete' cannot be used during constant- and zero-initialization, but on dynamic- and automatic-initialization phases.
- * (ii) dynamic-initialization of the variables in this translation unit happen in the order they appear here.
- * (iii) Calls to std::atexit(...) happen in reverse order as they are invoked.
+/** Log-linear histogram of allocation sizes (HdrHistogram-like).
+ * Sizes below 2^sub_bits are counted exactly, the rest of powers of two are split into 2^sub_bits
+ * linear sub-buckets, i.e., every bucket has a relative width of at most 1/2^sub_bits.
+ * Buckets are a flat array, so updating and merging never allocates.
  */
+struct SizeHistogram
+{
+    static constexpr unsigned sub_bits = 3;
+    static constexpr std::size_t sub_count = std::size_t{1} << sub_bits;
+    static constexpr std::size_t bucket_count = (std::numeric_limits<std::size_t>::digits - sub_bits + 1) * sub_count;
 
-static std::recursive_mutex memstats_lock = {};
+    std::array<std::size_t, bucket_count> count{};
 
-#if MEMSTAT_HAVE_TBB
-// Non-'constinit' is problematic because its initialization cannot be done as constant-initialization
-// and a call to 'new' during dynamic-initialization in another library may try to write to this variable even before its initialized.
-/*MEMSTATS_CONSTINIT*/ tbb::concurrent_vector<MemStatsInfo, MallocAllocator<MemStatsInfo>> memstats_events = {};
-#else
-// 'constinit' is good because it will be initialized before any dynamic-initialization happens
-#if __cpp_lib_constexpr_vector >= 201907L
-MEMSTATS_CONSTINIT
-#endif
-static std::vector<MemStatsInfo, MallocAllocator<MemStatsInfo>> memstats_events = {};
-#endif
+    static std::size_t bucket(std::size_t size)
+    {
+        if (size < sub_count)
+            return size;
+        const unsigned log = memstats_log2(size);
+        return (log - sub_bits + 1) * sub_count + ((size >> (log - sub_bits)) & (sub_count - 1));
+    }
 
-// Zero- and dynamic-initialization of a thread-local variable does not necessarily happen on any order related to the global ones
-static thread_local bool memstats_instrumentation_thread = init_memstats_instrumentation_thread();
+    // smallest size counted in 'bucket'
+    static std::size_t lower_bound(std::size_t bucket)
+    {
+        if (bucket < sub_count)
+            return bucket;
+        const unsigned shift = bucket / sub_count - 1;
+        return (sub_count + bucket % sub_count) << shift;
+    }
 
-// guard thread-local variable to instrument further delets at exit
-bool init_memstats_instrumentation_thread_guard()
-{
-    std::atexit([]{ memstats_instrumentation_thread = false; });
-    return true;
-}
-const static thread_local bool memstats_instrumentation_thread_guard = init_memstats_instrumentation_thread_guard();
+    // largest size counted in 'bucket'
+    static std::size_t upper_bound(std::size_t bucket)
+    {
+        return bucket + 1 == bucket_count ? std::numeric_limits<std::size_t>::max() : lower_bound(bucket + 1) - 1;
+    }
 
-// We need to make absolutely sure this is constinit so that 'memstats_instrumentation_global' is const-initialized,
-// otherwise threads will try to syncronize with an uninitialized variable
-#if MEMSTAT_ATOMIC_CONSTEXPR
-MEMSTATS_CONSTINIT static std::atomic<bool> memstats_instrumentation_global{false};
-#else
-#error "MemStats needs a conforming C++ standard library where 'std::atomic<bool>' can be const-initialized, i.e. its constructor is 'constexpr'!"
-#endif
+    void merge(const SizeHistogram &other)
+    {
+        for (std::size_t i = 0; i != bucket_count; ++i)
+            count[i] += other.count[i];
+    }
+};
 
-bool init_memstats_instrumentation_guard()
+// accumulated statistics of a set of 'new' allocations
+struct Stats
 {
-    bool instrument = false;
-    // Note this variable is const-initialized to false. Here we change it to true and syncronize other threads during dynamic initialization
-    if (char *ptr = std::getenv("MEMSTATS_ENABLE_INSTRUMENTATION"))
+    std::size_t count{0}, size{0}, max_size{0};
+    SizeHistogram size_freq;
+
+    // adds 'n' allocations of 'bytes' each
+    void add(std::size_t bytes, std::size_t n = 1)
     {
-        if (std::strcmp(ptr, "true") == 0 or std::strcmp(ptr, "1") == 0)
-            instrument = true;
-        else if (std::strcmp(ptr, "false") == 0 or std::strcmp(ptr, "0") == 0)
-            instrument = false;
-        else
-            std::cerr << "Option 'MEMSTATS_ENABLE_INSTRUMENTATION=" << ptr << "' not known. Fallback on default 'false'\n";
+        add(bytes, n, SizeHistogram::bucket(bytes));
     }
-    memstats_instrumentation_global.store(instrument, std::memory_order_release);
-    return instrument;
-}
 
-// Const-initialization (happens before dynamic-initialization) assigns 'false' to 'memstats_instrumentation_global' which is fine because no instrumentation will be done, and 'memstats_events' won't be called.
-// By defining 'memstats_instrumentation_global' after 'memstats_events' we guarantee that they are initialized on that order during dynamic-initialization.
-// meaning that we cannot register memory events before 'memstats_events' is initialized.
-// Note that we do not want this variable to be const-initialized to 'true' before dynamic-initialization, so we make sure this gets
-// dynamic-initialized in the correct order by delaying its initialization by a non-constexpr function.
-static bool memstats_instrumentation_guard = init_memstats_instrumentation_guard();
+    // adds 'n' allocations of 'bytes' each, where 'size_class' is 'SizeHistogram::bucket(bytes)'
+    void add(std::size_t bytes, std::size_t n, std::size_t size_class)
+    {
+        if (not bytes)
+            return;
+        count += n;
+        size += n * bytes;
+        max_size = std::max(max_size, bytes);
+        size_freq.count[size_class] += n;
+    }
 
-bool init_memstats_at_exit()
-{
-    static std::once_flag report_flag;
-    std::call_once(report_flag,
-        []{ std::atexit([]{
-            memstats_instrumentation_global.store(false, std::memory_order_release);
-            bool do_report_at_exit = true;
-            if (char *ptr = std::getenv("MEMSTATS_REPORT_AT_EXIT"))
-            {
-                if (std::strcmp(ptr, "true") == 0 or std::strcmp(ptr, "1") == 0)
-                    do_report_at_exit =  true;
-                else if (std::strcmp(ptr, "false") == 0 or std::strcmp(ptr, "0") == 0)
-                    do_report_at_exit =  false;
-                else
-                    std::cerr << "Option 'MEMSTATS_REPORT_AT_EXIT=" << ptr << "' not known. Fallback on default 'true'\n";
-            }
-            if (do_report_at_exit)
-                memstats_report("default");
-        });
-    });
-    return true;
-}
+    void merge(const Stats &other)
+    {
+        count += other.count;
+        size += other.size;
+        max_size = std::max(max_size, other.max_size);
+        size_freq.merge(other.size_freq);
+    }
+};
 
-// Destruction order fiasco also hits here. If a variable destroyed during dynamic-initialization-destruction (reverse order),
-// calls on 'delete' or direct accesses to 'memstats_events' may trigger an access to an already destroyed 'memstats_events'.
-// Therefore, we make sure to make a 'report' before 'memstats_events' is destroyed.
-static const bool memstats_at_exit_guard = init_memstats_at_exit();
+// distribution of durations in ticks of the event clock, e.g. time spent in 'malloc'/'free' or lifetime of blocks
+struct DurationStats
+{
+    std::size_t count{0}, max{0};
+    SizeHistogram ticks;
 
-/** Overview of initialization/destruction order:
- * memstats_instrumentation_global = false;                                                     // const-initialization
- * memstats_lock = {};                                                                          // dynamic-initialization
- * memstats_events = {};                                                                        // dynamic-initialization
- * init_memstats_instrumentation_guard(); -> memstats_instrumentation_global = true;            // dynamic-initialization
- * memstats_at_exit_guard = init_memstats_at_exit();                                    // dynamic-initialization
- * main();
- * memstats_instrumentation_global = false;
- * std::atexit(default_report); -> read memstats_events                                         // dynamic-initialization-destruction
- * memstats_events.~vector<MemStatsInfo, MallocAllocator<MemStatsInfo>>();                      // dynamic-initialization-destruction
- * memstats_lock.~mutex();                                                                      // dynamic-initialization-destruction
- */
+    // adds 'n' durations of 'duration' ticks each
+    void add(std::size_t duration, std::size_t n = 1)
+    {
+        count += n;
+        max = std::max(max, duration);
+        ticks.count[SizeHistogram::bucket(duration)] += n;
+    }
 
-// bin representation of percentage from 0% to 100%
-static const std::array<const char*,4> memstats_str_precentage_punctuation{" ", ".", ":", "!"};
-static const std::array<const char*,4> memstats_str_precentage_circle{" ", ".", "o", "O"};
-static const std::array<const char*,5> memstats_str_precentage_shadow{" ", "░", "▒", "▓", "█"};
-static const std::array<const char*,5> memstats_str_precentage_wire{" ", "-", "~", "=", "#"};
-static const std::array<const char*,9> memstats_str_precentage_box{" ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
-static const std::array<const char*,10> memstats_str_precentage_number{"0", "1", "2", "3", "4", "5", "6", "7", "8", "9"};
+    void merge(const DurationStats &other)
+    {
+        count += other.count;
+        max = std::max(max, other.max);
+        ticks.merge(other.ticks);
+    }
 
-std::pair<char const * const *, std::size_t> memstats_str_hist_representation()
-{
-    if (const char *ptr = std::getenv("MEMSTATS_HISTOGRAM_REPRESENTATION"))
+    // upper bound of the duration of a fraction 'q' of the counted ones
+    std::size_t quantile(double q) const
     {
-        if (std::strcmp(ptr, "box") == 0)
-            return std::make_pair(memstats_str_precentage_box.data(), memstats_str_precentage_box.size());
-        if (std::strcmp(ptr, "number") == 0)
-            return std::make_pair(memstats_str_precentage_number.data(), memstats_str_precentage_number.size());
-        if (std::strcmp(ptr, "punctuation") == 0)
-            return std::make_pair(memstats_str_precentage_punctuation.data(), memstats_str_precentage_punctuation.size());
-        if (std::strcmp(ptr, "shadow") == 0)
-            return std::make_pair(memstats_str_precentage_shadow.data(), memstats_str_precentage_shadow.size());
-        if (std::strcmp(ptr, "wire") == 0)
-            return std::make_pair(memstats_str_precentage_wire.data(), memstats_str_precentage_wire.size());
-        if (std::strcmp(ptr, "circle") == 0)
-            return std::make_pair(memstats_str_precentage_circle.data(), memstats_str_precentage_circle.size());
-        std::cerr << "Option 'MEMSTATS_HISTOGRAM_REPRESENTATION=" << ptr << "' not known. Fallback on default 'box'\n";
+        const double rank = std::ceil(q * double(count));
+        std::size_t seen = 0;
+        for (std::size_t bucket = 0; bucket != SizeHistogram::bucket_count; ++bucket)
+            if ((seen += ticks.count[bucket]) and double(seen) >= rank)
+                return std::min(SizeHistogram::upper_bound(bucket), max);
+        return max;
     }
-    return std::make_pair(memstats_str_precentage_box.data(), memstats_str_precentage_box.size());
-}
 
-unsigned short memstats_bins()
-{
-    if (const char *ptr = std::getenv("MEMSTATS_BINS"))
+    // number of durations that are certainly not longer than 'limit', up to the width of the buckets
+    std::size_t below(std::size_t limit) const
     {
-        try
-        {
-            return std::stoi(ptr);
-        }
-        catch (...)
-        {
-            std::cerr << "Option 'MEMSTATS_BINS=" << ptr << "' not known. Fallback on default '15'\n";
-        }
+        std::size_t seen = 0;
+        for (std::size_t bucket = 0; bucket != SizeHistogram::bucket_count and SizeHistogram::upper_bound(bucket) <= limit; ++bucket)
+            seen += ticks.count[bucket];
+        return max <= limit ? count : seen;
     }
-    return 15;
-}
+};
 
-void MemStatsInfo::record(void *ptr, std::size_t sz)
+enum class MemStatsOperation : unsigned char
 {
-    auto time = std::chrono::high_resolution_clock::now();
-    MemStatsInfo info;
-    info.ptr = ptr;
-    info.size = sz;
-    info.time = time;
-    info.thread = std::this_thread::get_id();
-#if MEMSTAT_HAVE_STACKTRACE
-    info.stacktrace = info.stacktrace.current(2);
-#endif
-#if !MEMSTAT_HAVE_TBB
-    std::unique_lock<std::recursive_mutex> lk{memstats_lock};
-#endif
-    memstats_events.emplace_back(std::move(info));
-}
+    allocation,
+    deallocation
+};
 
-template <class Key, class T>
-using unordered_map = std::unordered_map<Key, T, std::hash<Key>, std::equal_to<Key>, MallocAllocator<std::pair<const Key, T>>>;
-using string = std::basic_string<char, std::char_traits<char>, MallocAllocator<char>>;
-using stringstream = std::basic_stringstream<char, std::char_traits<char>, MallocAllocator<char>>;
+struct MemStatsLiveBlock;
 
-void print_legend()
+struct MemStatsInfo
 {
-    std::cout << "\nMemStats Legend:\n\n";
-    std::cout << "  [{hist}]{max} | {accum}({count}) | {pos}\n\n";
-    std::cout << "• hist:   Distribution of number of 'new' allocations for a given number of bytes\n";
-    std::cout << "• max:    Maximum allocation requested to 'new'\n";
-    std::cout << "• accum:  Accumulated number of bytes requested\n";
-    std::cout << "• count:  Number of total allocation requests\n";
-    std::cout << "• pos:    Position of the measurment\n";
-    std::cout << "\nMemStats Histogram Legend:\n\n";
-    const auto str_precentage = memstats_str_hist_representation();
-    string buffer;
-    double per_width = 100. / str_precentage.second;
-    for (std::size_t i = 0; i != str_precentage.second; ++i)
-      std::cout << "• \'" << str_precentage.first[i] << "\' -> [" << std::fixed
-                << std::setw(4) << std::setprecision(1) << i * per_width
-                << "%, " << std::setw(5) << (i + 1) * per_width << '%'
-                << (i + 1 == str_precentage.second ? ']' : ')') << std::endl;
-}
+    const void *ptr = nullptr;
+    // requested bytes on allocations, freed bytes on deallocations if known (otherwise 0)
+    std::size_t size = 0;
+    // 'SizeHistogram::bucket(size)', computed once when recorded
+    std::size_t size_class = 0;
+    // ticks of 'memstats_clock', see 'memstats_tick_seconds'
+    std::int64_t time = 0;
+    MemStatsOperation operation = MemStatsOperation::allocation;
+    // alignment requested to an aligned 'new'/'delete', 0 for the default alignment
+    std::size_t alignment = 0;
+    // id of the stacktrace in 'memstats_stacks', 0 when not captured
+    std::uint32_t stack = 0;
+    // id of the innermost region in 'memstats_regions' opened by the recording thread, 0 when none
+    std::uint32_t region = 0;
+    // ticks spent in 'malloc'/'free', only measured by 'new'/'delete' when 'timed'
+    std::uint64_t latency = 0;
+    bool timed = false;
+    // deallocations of live blocks when lifetimes are measured: ticks since the allocation, stacktrace id of the allocation
+    // and number of allocations represented by the block, 'lifetime_weight' is 0 otherwise
+    std::uint64_t lifetime = 0;
+    std::uint32_t origin = 0;
+    std::size_t lifetime_weight = 0;
 
-void memstats_report(const char * report_name)
-{
-    auto lock = std::unique_lock<std::recursive_mutex>{memstats_lock};
-    if (memstats_events.size() == 0)
-        return;
-    std::cout << "\n------------------- MemStats " << report_name << " -------------------\n";
-    struct Stats
-    {
-        std::size_t count{0}, size{0}, max_size{0};
-        unordered_map<std::size_t, std::size_t> size_freq;
-    };
-    Stats global_stats;
-    unordered_map<std::thread::id, Stats> thread_stats;
-#if MEMSTAT_HAVE_STACKTRACE
-    unordered_map<std::basic_stacktrace<MallocAllocator<std::stacktrace_entry>>, Stats> stacktrace_stats;
-    unordered_map<std::stacktrace_entry, Stats> stacktrace_entry_stats;
-#endif
-    for (const MemStatsInfo &info : memstats_events)
-    {
-        auto register_stats = [&](Stats &stats)
-        {
-            if (info.size)
-                ++stats.count;
-            stats.size += info.size;
-            stats.max_size = std::max(stats.max_size, info.size);
-            if (info.size)
-                ++stats.size_freq[info.size];
-        };
+    // 'freed' is the live block released by a deallocation, if any
+    static void record(void *ptr, std::size_t sz, MemStatsOperation operation, std::size_t alignment, std::int64_t time,
+                       bool timed = false, std::uint64_t latency = 0, const MemStatsLiveBlock *freed = nullptr);
+};
 
-        register_stats(global_stats);
-        register_stats(thread_stats[info.thread]);
+// time spent in the allocation and deallocation functions
+struct MemStatsLatency
+{
+    DurationStats allocation, deallocation;
 
-#if MEMSTAT_HAVE_STACKTRACE
-        register_stats(stacktrace_stats[info.stacktrace]);
-        for (auto entry : info.stacktrace)
-            register_stats(stacktrace_entry_stats[entry]);
-#endif
+    void add(MemStatsOperation operation, std::size_t latency, std::size_t n)
+    {
+        (operation == MemStatsOperation::allocation ? allocation : deallocation).add(latency, n);
     }
-    // clean up vector
-    memstats_events.clear();
 
-    static const std::array<char, 11> metric_prefix{' ', 'k', 'M', 'G', 'T', 'P', 'E', 'Z', 'Y', 'R', 'Q'};
-    auto bytes_to_string = [&](std::size_t bytes)
+    void merge(const MemStatsLatency &other)
     {
-        stringstream stream;
-        short base = std::floor(std::log2(bytes) / 10);
-        if (base > metric_prefix.size())
-            throw std::out_of_range{"Too many bytes to use SI prefixes"};
-        stream << short(bytes / (std::pow(1024, base))) << metric_prefix[base] << 'B';
-        return stream.str();
-    };
+        allocation.merge(other.allocation);
+        deallocation.merge(other.deallocation);
+    }
+};
 
-    auto int_to_string = [&](std::size_t val)
-    {
-        stringstream stream;
-        short base = std::floor(std::log10(val) / 3);
-        if (base > metric_prefix.size())
-            throw std::out_of_range{"Integer is too big to use SI prefixes"};
-        stream << short(val / (std::pow(1000, base))) << metric_prefix[base];
-        return stream.str();
-    };
-    const auto str_precentage = memstats_str_hist_representation();
-    const auto bins = memstats_bins();
-    auto format_histogram = [&](const Stats &stats)
+/** Compact form of a 'MemStatsInfo' as stored in the thread buffers.
+ * Timestamps are stored as the ticks elapsed since the previous event. Values that do not fit (sizes of 4GiB or more,
+ * time gaps of 2^32 ticks or more), the address of the block (only needed by traces of the live heap), the time spent
+ * in 'malloc'/'free' (only when measured) and the lifetime of freed blocks (only when measured, with the stacktrace of their
+ * allocation in 'stack' and a weight record when sampled) are stored in extension records right before the event they
+ * belong to, with their 64-bit value split into 'size' and 'delta'. The region of the events only changes now and then,
+ * so it is stored in an extension record before the first event of a different region and applies to the following ones.
+ */
+struct MemStatsPackedInfo
+{
+    enum Kind : std::uint8_t
     {
-        std::vector<std::size_t, MallocAllocator<std::size_t>> hist(bins, 0);
-        std::size_t max_size = 0;
-        for (const auto &frec : stats.size_freq)
-        {
-            std::size_t size = frec.first, count = frec.second;
-            assert(size <= stats.max_size);
-            auto bin = (bins * (size - 1)) / (stats.max_size);
-            max_size = std::max(hist[bin] += count, max_size);
-        }
-        stringstream stream;
-        stream << "[";
-        for (auto size : hist) {
-          const std::size_t bin_entry =
-            (size * str_precentage.second) / max_size;
-          // maximum value (size==max_size) will be out of range so we need to guard agains that
-          stream << str_precentage.first[std::min(bin_entry, str_precentage.second - 1)];
-        }
-        stream << "]" << std::left<< std::setw(6) << bytes_to_string(stats.max_size);
-        return stream.str();
+        allocation,
+        deallocation,
+        extension_size,
+        extension_delta,
+        extension_ptr,
+        extension_latency,
+        extension_lifetime,
+        extension_weight,
+        extension_region
     };
 
-    std::cout << format_histogram(global_stats) << " | " << std::right
-              << std::setw(6) << bytes_to_string(global_stats.size) << '('
-              << std::left << std::setw(5) << int_to_string(global_stats.count)
-              << ") | Total\n";
+    std::uint32_t size;
+    std::uint32_t delta;
+    std::uint32_t stack;
+    // 'SizeHistogram::bucket' of the whole size, used when folding instead of computing it again
+    std::uint16_t size_class;
+    std::uint8_t kind;
+    // log2 of the alignment plus one, 0 for the default alignment
+    std::uint8_t alignment;
 
-    for (const auto &pair : thread_stats)
-      if (pair.second.size) {
-        std::cout << format_histogram(pair.second) << " | " << std::right
-                  << std::setw(6) << bytes_to_string(pair.second.size) << '('
-                  << std::left << std::setw(5) << int_to_string(pair.second.count)
-                  << ") | Thread " << pair.first << std::endl;
-      }
+    static MemStatsPackedInfo extension(Kind kind, std::uint64_t value)
+    {
+        MemStatsPackedInfo packed{};
+        packed.size = std::uint32_t(value);
+        packed.delta = std::uint32_t(value >> 32);
+        packed.kind = kind;
+        return packed;
+    }
 
-#if MEMSTAT_HAVE_STACKTRACE
-    for (auto [stacktrace_entry, stats] : stacktrace_entry_stats)
+    std::uint64_t value() const
     {
-      if (stats.size) {
-        std::cout << format_histogram(stats) << " | " << std::right
-                  << std::setw(6) << bytes_to_string(stats.size) << '('
-                  << std::left << std::setw(5)
-                  << int_to_string(stats.count) << ") | ";
-        std::cout << stacktrace_entry << std::endl;
-      }
+        return std::uint64_t(size) | (std::uint64_t(delta) << 32);
     }
-#endif
-    // avoid printing legend several times, so call once at exit
-    static std::once_flag legend_flag;
-    std::call_once(legend_flag, []()
-                    { std::atexit(print_legend); });
-}
+};
 
-template<class T, class U = T>
-T exchange(T& obj, U&& new_value)
-{
-    T old_value = std::move(obj);
-    obj = std::forward<U>(new_value);
-    return old_value;
-}
+static_assert(sizeof(MemStatsPackedInfo) == 16, "Events are meant to be packed in 16 bytes");
+static_assert(SizeHistogram::bucket_count <= std::numeric_limits<std::uint16_t>::max(), "Size classes are stored in 16 bits");
 
-bool memstats_enable_thread_instrumentation()
+/** Calls 'f' with each event of 'events', where 'time' and 'region' are the ones of the event preceding the first one.
+ * @return Whether all the records are known, decoding stops at the first unknown one (only possible in corrupted traces).
+ */
+template <class F>
+bool memstats_decode(const MemStatsPackedInfo *events, std::size_t size, std::int64_t time, std::uint32_t region, F f)
 {
-    return exchange(memstats_instrumentation_thread, true);
+    MemStatsInfo info;
+    info.time = time;
+    info.region = region;
+    bool wide_size = false, wide_delta = false;
+    for (std::size_t i = 0; i != size; ++i)
+    {
+        const MemStatsPackedInfo &packed = events[i];
+        switch (packed.kind)
+        {
+        case MemStatsPackedInfo::allocation:
+        case MemStatsPackedInfo::deallocation:
+            if (packed.alignment > std::numeric_limits<std::size_t>::digits or packed.size_class >= SizeHistogram::bucket_count)
+                return false;
+            break;
+        case MemStatsPackedInfo::extension_size:
+            info.size = std::size_t(packed.value());
+            wide_size = true;
+            continue;
+        case MemStatsPackedInfo::extension_delta:
+            info.time += std::int64_t(packed.value());
+            wide_delta = true;
+            continue;
+        case MemStatsPackedInfo::extension_ptr:
+            info.ptr = reinterpret_cast<const void *>(std::uintptr_t(packed.value()));
+            continue;
+        case MemStatsPackedInfo::extension_latency:
+            info.latency = packed.value();
+            info.timed = true;
+            continue;
+        case MemStatsPackedInfo::extension_lifetime:
+            info.lifetime = packed.value();
+            info.origin = packed.stack;
+            info.lifetime_weight = 1;
+            continue;
+        case MemStatsPackedInfo::extension_weight:
+            info.lifetime_weight = std::size_t(packed.value());
+            continue;
+        case MemStatsPackedInfo::extension_region:
+            info.region = std::uint32_t(packed.value());
+            continue;
+        default:
+            return false;
+        }
+        if (not wide_size)
+            info.size = packed.size;
+        if (not wide_delta)
+            info.time += packed.delta;
+        info.operation = packed.kind == MemStatsPackedInfo::allocation ? MemStatsOperation::allocation : MemStatsOperation::deallocation;
+        info.alignment = packed.alignment ? std::size_t{1} << (packed.alignment - 1) : 0;
+        info.size_class = packed.size_class;
+        info.stack = packed.stack;
+        f(static_cast<const MemStatsInfo &>(info));
+        info.ptr = nullptr;
+        info.latency = 0;
+        info.timed = false;
+        info.lifetime_weight = 0;
+        wide_size = wide_delta = false;
+    }
+    return true;
 }
 
-bool memstats_disable_thread_instrumentation()
+// fixed-size block of events, chunks are linked so that growing never moves recorded events
+struct MemStatsChunk
 {
-    return exchange(memstats_instrumentation_thread, false);
-}
+    static constexpr std::size_t capacity = 4096;
+
+    MemStatsChunk *next = nullptr;
+    std::size_t size = 0;
+    // time and region of the event preceding the first one of the chunk, so that chunks can be decoded on their own
+    std::int64_t time = 0;
+    std::uint32_t region = 0;
+    // order in which chunks are started by all the threads, only counted when tracing, see 'memstats_chunk_sequence'
+    std::uint64_t sequence = 0;
+    MemStatsPackedInfo events[capacity];
+
+    // calls 'f' with each event of the chunk
+    template <class F>
+    void for_each(F f) const
+    {
+        memstats_decode(events, size, time, region, f);
+    }
+};
+
+/** Allocations, allocated bytes and net live bytes (allocated minus freed) per span of time, for the timeline.
+ * Spans are 2^'shift' ticks wide from 'origin'. When an event falls out of the 'capacity' spans, pairs of spans are merged
+ * until it fits, so a series stays bounded whatever the duration of the run, and always has at least a quarter of its
+ * capacity between its first and last events once spans got merged.
+ */
+struct MemStatsSeries
+{
+    static constexpr std::size_t capacity = 256;
+
+    std::int64_t origin = 0;
+    unsigned shift = 0;
+    vector<std::size_t> count, bytes;
+    vector<long long> net;
+    // deallocations of unknown size, the net live bytes are not known with them
+    std::size_t unsized = 0;
+
+    // 'n' is the number of allocations represented by an allocation event
+    void add(std::int64_t time, MemStatsOperation operation, std::size_t size, std::size_t n)
+    {
+        if (operation == MemStatsOperation::deallocation and not size)
+            ++unsized;
+        const std::size_t span = locate(time);
+        if (operation == MemStatsOperation::deallocation)
+            net[span] -= size;
+        else if (size)
+        {
+            count[span] += n;
+            bytes[span] += n * size;
+            net[span] += n * size;
+        }
+    }
+
+    void merge(const MemStatsSeries &other)
+    {
+        if (count.empty())
+        {
+            const std::size_t own_unsized = unsized;
+            *this = other;
+            unsized += own_unsized;
+            return;
+        }
+        unsized += other.unsized;
+        while (not count.empty() and shift < other.shift)
+            coarsen();
+        // spans of 'other' fall into the span containing their start
+        for (std::size_t i = 0; i != other.count.size(); ++i)
+            if (other.count[i] or other.net[i])
+            {
+                const std::size_t span = locate(other.origin + std::int64_t(std::uint64_t(i) << other.shift));
+                count[span] += other.count[i];
+                bytes[span] += other.bytes[i];
+                net[span] += other.net[i];
+            }
+    }
+
+    void clear()
+    {
+        count.clear();
+        bytes.clear();
+        net.clear();
+        shift = 0;
+        unsized = 0;
+    }
+
+private:
+    // index of the span of 'time', made room for
+    std::size_t locate(std::int64_t time)
+    {
+        if (count.empty())
+            origin = time;
+        for (;; coarsen())
+        {
+            if (time < origin)
+            {
+                // spans are added before the first one, 'origin' stays a multiple of the width away from 'time'
+                const std::uint64_t missing = ((std::uint64_t(origin - time) - 1) >> shift) + 1;
+                if (count.size() + missing > capacity)
+                    continue;
+                count.insert(count.begin(), missing, 0);
+                bytes.insert(bytes.begin(), missing, 0);
+                net.insert(net.begin(), missing, 0);
+                origin -= std::int64_t(missing << shift);
+            }
+            const std::uint64_t span = std::uint64_t(time - origin) >> shift;
+            if (span >= capacity)
+                continue;
+            if (span >= count.size())
+            {
+                count.resize(span + 1);
+                bytes.resize(span + 1);
+                net.resize(span + 1);
+            }
+            return std::size_t(span);
+        }
+    }
+
+    // doubles the width of the spans
+    void coarsen()
+    {
+        const std::size_t size = (count.size() + 1) / 2;
+        for (std::size_t i = 0; i != size; ++i)
+        {
+            const std::size_t last = std::min(2 * i + 1, count.size() - 1);
+            count[i] = count[2 * i] + (last != 2 * i ? count[last] : 0);
+            bytes[i] = bytes[2 * i] + (last != 2 * i ? bytes[last] : 0);
+            net[i] = net[2 * i] + (last != 2 * i ? net[last] : 0);
+        }
+        count.resize(size);
+        bytes.resize(size);
+        net.resize(size);
+        ++shift;
+    }
+};
+
+// statistics of folded events
+struct MemStatsAggregate
+{
+    Stats stats;
+    // only filled when 'memstats_latency' is enabled
+    MemStatsLatency latency;
+    // lifetimes of the freed blocks, only filled when 'memstats_lifetime' is enabled
+    DurationStats lifetime;
+    // events over time, only filled when 'memstats_timeline' is enabled
+    MemStatsSeries series;
+    // statistics per id of the innermost region, without the ones of the regions nested in it
+    unordered_map<std::uint32_t, Stats> region_stats;
+#if MEMSTAT_HAVE_STACKTRACE
+    // statistics per id of stacktrace, lifetimes per id of the stacktrace of the allocation
+    unordered_map<std::uint32_t, Stats> stack_stats;
+    unordered_map<std::uint32_t, MemStatsLatency> stack_latency;
+    unordered_map<std::uint32_t, DurationStats> stack_lifetime;
+#endif
+
+    // state for the random rounding of sampled allocations
+    std::uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+    void add(const MemStatsInfo &info);
+
+    void merge(const MemStatsAggregate &other)
+    {
+        stats.merge(other.stats);
+        latency.merge(other.latency);
+        lifetime.merge(other.lifetime);
+        series.merge(other.series);
+        for (const auto &pair : other.region_stats)
+            region_stats[pair.first].merge(pair.second);
+#if MEMSTAT_HAVE_STACKTRACE
+        for (const auto &pair : other.stack_stats)
+            stack_stats[pair.first].merge(pair.second);
+        for (const auto &pair : other.stack_latency)
+            stack_latency[pair.first].merge(pair.second);
+        for (const auto &pair : other.stack_lifetime)
+            stack_lifetime[pair.first].merge(pair.second);
+#endif
+    }
+
+    void clear()
+    {
+        stats = Stats{};
+        latency = MemStatsLatency{};
+        lifetime = DurationStats{};
+        series.clear();
+        region_stats.clear();
+#if MEMSTAT_HAVE_STACKTRACE
+        stack_stats.clear();
+        stack_latency.clear();
+        stack_lifetime.clear();
+#endif
+    }
+};
+
+/** Allocation counters of one thread, readable by any thread at any time without locking.
+ * Only the owning thread writes them, so updates are relaxed loads and stores without read-modify-write instructions.
+ * They are aligned to their own cache lines, so that threads polling them do not contend with the rest of the thread buffer.
+ */
+struct alignas(64) MemStatsCounters
+{
+    static constexpr std::size_t size_class_count = 64;
+    static_assert(std::numeric_limits<std::size_t>::digits <= size_class_count, "Size classes are powers of two of 'std::size_t'");
+
+    std::atomic<std::uint64_t> allocations{0}, deallocations{0}, allocated_bytes{0}, deallocated_bytes{0};
+    // hash of the id of the owning thread, 0 while the buffer is not owned. Stored on registration and cleared on retirement,
+    // so that readers never read the id of a buffer being claimed by another thread.
+    std::atomic<std::size_t> thread{0};
+    // allocations per power of two of their size, class 'i' counts sizes in [2^i, 2^(i+1)) and sizes 0 fall into class 0
+    std::atomic<std::uint64_t> size_classes[size_class_count]{};
+
+    static void add(std::atomic<std::uint64_t> &counter, std::uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void allocation(std::size_t size)
+    {
+        add(allocations, 1);
+        add(allocated_bytes, size);
+        add(size_classes[size ? memstats_log2(size) : 0], 1);
+    }
+
+    void deallocation(std::size_t size)
+    {
+        add(deallocations, 1);
+        add(deallocated_bytes, size);
+    }
+
+    // adds the counters of 'other', may be called by several threads at once
+    void merge(const MemStatsCounters &other)
+    {
+        allocations.fetch_add(other.allocations.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        deallocations.fetch_add(other.deallocations.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        allocated_bytes.fetch_add(other.allocated_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        deallocated_bytes.fetch_add(other.deallocated_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        for (std::size_t i = 0; i != size_class_count; ++i)
+            size_classes[i].fetch_add(other.size_classes[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    void reset()
+    {
+        allocations.store(0, std::memory_order_relaxed);
+        deallocations.store(0, std::memory_order_relaxed);
+        allocated_bytes.store(0, std::memory_order_relaxed);
+        deallocated_bytes.store(0, std::memory_order_relaxed);
+        for (std::size_t i = 0; i != size_class_count; ++i)
+            size_classes[i].store(0, std::memory_order_relaxed);
+    }
+};
+
+// copies the counters of the thread 'thread' (the hash of its id) for 'memstats_thread_counters'
+void memstats_copy_counters(const MemStatsCounters &counters, std::size_t thread, memstats_counters &copy)
+{
+    copy.thread = thread;
+    copy.allocations = counters.allocations.load(std::memory_order_relaxed);
+    copy.deallocations = counters.deallocations.load(std::memory_order_relaxed);
+    copy.allocated_bytes = counters.allocated_bytes.load(std::memory_order_relaxed);
+    copy.deallocated_bytes = counters.deallocated_bytes.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i != MemStatsCounters::size_class_count; ++i)
+        copy.size_classes[i] = counters.size_classes[i].load(std::memory_order_relaxed);
+}
+
+bool init_memstats_membarrier()
+{
+#if MEMSTATS_HAVE_MEMBARRIER
+    const long commands = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+    return commands > 0 and (commands & MEMBARRIER_CMD_PRIVATE_EXPEDITED)
+        and syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+// Whether 'memstats_barrier' makes every running thread execute a full memory barrier. The registration is inherited by
+// forked processes. Zero-initialized to 'false', threads recording before then execute the barrier themselves, which
+// is correct either way.
+static const bool memstats_membarrier = init_memstats_membarrier();
+
+// Orders the memory accesses of every thread of the process, as if each of them executed a full memory barrier
+// meanwhile. Called by reports instead of having recording threads pay for one on every event.
+void memstats_barrier()
+{
+#if MEMSTATS_HAVE_MEMBARRIER
+    if (memstats_membarrier)
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+#endif
+}
+
+/** Events recorded by one thread.
+ * Each thread appends into its own buffer without any lock, reports take the chunks written so far
+ * as a whole list and leave the thread to start a new one. Buffers are linked into a global
+ * registry the first time a thread records an event and are never removed from it. When a thread
+ * exits, its buffer is retired: the next report folds its events under the id of the thread, after
+ * which the buffer is free to be claimed by the next thread that registers.
+ */
+struct MemStatsThread
+{
+    enum State : unsigned char
+    {
+        active,  // owned by a running thread
+        retired, // its thread exited, events not reported yet
+        vacant,  // reported, waiting for a new thread
+        claimed  // being set up for a new thread
+    };
+
+    std::thread::id thread = {};
+    MemStatsThread *next = nullptr; // registry link, immutable after registration
+    std::atomic<unsigned char> state{active};
+    // incremented when the buffer is retired, live blocks of an older generation belong to exited threads.
+    // Only changed with every shard of 'memstats_live_table' locked.
+    std::uint32_t generation = 0;
+    // chunks being written by the owning thread
+    MemStatsChunk *head = nullptr, *tail = nullptr;
+    // 'head' as published to reports, which take the whole list by exchanging it with 'nullptr'. The owning thread
+    // reloads it before each event and starts a new list when it does not match 'head' anymore.
+    std::atomic<MemStatsChunk *> current{nullptr};
+    // Statistics aggregated by the owning thread itself, on record or when it folds its own chunks. Allocated while
+    // recording when missing, reports take them as a whole by exchanging them with 'nullptr'.
+    std::atomic<MemStatsAggregate *> aggregated{nullptr};
+    // whether the owning thread is recording an event, reports wait until it is done after taking 'current' and 'aggregated'
+    std::atomic<bool> writing{false};
+    // time and region of the last event pushed, timestamps are stored relative to it
+    std::int64_t time = 0;
+    std::uint32_t region = 0;
+
+    // statistics of the events folded by reports, and the ones aggregated by the owning thread taken by 'take'.
+    // Only accessed under 'memstats_lock'.
+    MemStatsAggregate folded;
+    MemStatsAggregate *taken_aggregate = nullptr;
+
+    // Chunks filled by the owning thread and handed over to the background drain thread (most recent first),
+    // and chunks already drained that the owning thread may reuse. Both are only taken as a whole list.
+    std::atomic<MemStatsChunk *> full{nullptr};
+    std::atomic<MemStatsChunk *> spare{nullptr};
+    // number of chunks in 'full', past 'max_full' the owning thread takes them back and folds them itself
+    std::atomic<std::size_t> full_size{0};
+    static constexpr std::size_t max_full = 64;
+    // spare chunks already taken by the owning thread
+    MemStatsChunk *spares = nullptr;
+    // statistics of the chunks drained in the background, only accessed under 'memstats_drained_lock'
+    MemStatsAggregate drained;
+    // state for the weights of the live blocks allocated by the owning thread when sampling
+    std::uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+    // bytes allocated by this thread that are still live (deallocations may come from other threads)
+    std::atomic<std::size_t> live_bytes{0};
+    // maximum of 'live_bytes' since the last report, only written by the owning thread and the report
+    std::atomic<std::size_t> peak_bytes{0};
+
+    // counters of every instrumented 'new'/'delete', sampled or not, never reset
+    MemStatsCounters counters;
+
+    // starts recording an event, chunks taken by a report meanwhile are left to it
+    void begin_write()
+    {
+        // Either this thread sees 'current' taken or the report sees it writing. This needs a full barrier between
+        // the store and the load, which reports execute on behalf of this thread with 'memstats_barrier' when they can.
+        if (memstats_membarrier)
+        {
+            writing.store(true, std::memory_order_relaxed);
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            if (current.load(std::memory_order_relaxed) != head)
+                head = tail = nullptr;
+        }
+        else
+        {
+            writing.store(true, std::memory_order_seq_cst);
+            if (current.load(std::memory_order_seq_cst) != head)
+                head = tail = nullptr;
+        }
+    }
+
+    void end_write()
+    {
+        writing.store(false, std::memory_order_release);
+    }
+
+    // takes the chunks back from 'current' while recording, returns false if a report took them meanwhile
+    bool detach()
+    {
+        MemStatsChunk *expected = head;
+        return current.compare_exchange_strong(expected, nullptr, std::memory_order_seq_cst);
+    }
+
+    // starts a new list of chunks with 'chunk' while recording
+    void publish(MemStatsChunk *chunk)
+    {
+        head = tail = chunk;
+        current.store(chunk, std::memory_order_release);
+    }
+
+    // statistics aggregated by the owning thread, allocated again once taken by a report. Only called while recording.
+    MemStatsAggregate &aggregate();
+
+    // Takes the chunks recorded so far, in recording order, and the statistics aggregated by the owning thread. The event
+    // being recorded meanwhile (if any) may still be written to them until 'settle' returns, which is called after
+    // 'memstats_barrier'. Both must be called with 'memstats_lock' held.
+    MemStatsChunk *take();
+
+    // waits until the event being recorded when taken is written, then merges the statistics taken into 'folded'
+    void settle();
+
+    // gives back a list of chunks taken from this thread, after they have been folded
+    void give_spare(MemStatsChunk *chunks);
+
+    // makes room for one more event at 'tail'
+    void grow();
+
+    // takes a chunk drained before or a new one
+    MemStatsChunk *spare_chunk();
+
+    // takes the chunks handed over in 'full', in recording order
+    MemStatsChunk *take_full();
+
+    // pushes a chunk to 'full'
+    void give_full(MemStatsChunk *chunk);
+
+    void push(const MemStatsInfo &info);
+
+    // drop all the aggregated statistics
+    void clear()
+    {
+        folded.clear();
+        drained.clear();
+    }
+};
+
+// reads a boolean option from the environment, 'fallback' is used when the option is not set or not known
+bool memstats_env_bool(const char *key, bool fallback)
+{
+    if (char *ptr = std::getenv(key))
+    {
+        if (std::strcmp(ptr, "true") == 0 or std::strcmp(ptr, "1") == 0)
+            return true;
+        if (std::strcmp(ptr, "false") == 0 or std::strcmp(ptr, "0") == 0)
+            return false;
+        std::cerr << "Option '" << key << "=" << ptr << "' not known. Fallback on default '" << (fallback ? "true" : "false") << "'\n";
+    }
+    return fallback;
+}
+
+bool init_memstats_instrumentation_thread()
+{
+    return memstats_env_bool("MEMSTATS_THREAD_INSTRUMENTATION_INIT", false);
+}
+
+// allocation that has not been deallocated yet
+struct MemStatsLiveBlock
+{
+    const void *ptr = nullptr;
+    std::size_t size = 0;
+    // number of allocations represented by this block when sampling
+    std::size_t weight = 0;
+    MemStatsThread *owner = nullptr;
+    // thread that allocated it, the buffer of the owner may be reused by other threads after it exits
+    std::thread::id thread = {};
+    // id of the stacktrace of the allocation
+    std::uint32_t stack = 0;
+    // 'generation' of the owner when allocated
+    std::uint32_t generation = 0;
+    // time of the allocation
+    std::int64_t time = 0;
+};
+
+// lock for short critical sections that may be entered at any point of the program, it never allocates
+struct MemStatsSpinLock
+{
+    std::atomic<bool> locked{false};
+
+    void lock()
+    {
+        while (locked.exchange(true, std::memory_order_acquire))
+            while (locked.load(std::memory_order_relaxed))
+                std::this_thread::yield();
+    }
+
+    void unlock()
+    {
+        locked.store(false, std::memory_order_release);
+    }
+};
+
+/** Index from pointers to live allocations.
+ * Split into shards, each one an open-addressing table with linear probing guarded by its own spin lock,
+ * so that threads allocating concurrently rarely contend. Storage is allocated through 'MallocAllocator'.
+ * It is const-initialized and never destroyed, so it can be used at any point of the program.
+ */
+class MemStatsLiveTable
+{
+    static constexpr std::size_t shard_count = 64;
+
+    struct alignas(64) Shard : MemStatsSpinLock
+    {
+        MemStatsLiveBlock *blocks = nullptr;
+        std::size_t capacity = 0, size = 0;
+
+        std::size_t home(const void *ptr) const
+        {
+            return (hash(ptr) / shard_count) & (capacity - 1);
+        }
+
+        void grow()
+        {
+            MemStatsLiveBlock *old_blocks = blocks;
+            std::size_t old_capacity = capacity;
+            capacity = capacity ? 2 * capacity : 1024;
+            blocks = MallocAllocator<MemStatsLiveBlock>{}.allocate(capacity);
+            for (std::size_t i = 0; i != capacity; ++i)
+                ::new (blocks + i) MemStatsLiveBlock;
+            for (std::size_t i = 0; i != old_capacity; ++i)
+                if (old_blocks[i].ptr)
+                {
+                    std::size_t j = home(old_blocks[i].ptr);
+                    while (blocks[j].ptr)
+                        j = (j + 1) & (capacity - 1);
+                    blocks[j] = old_blocks[i];
+                }
+            if (old_blocks)
+                MallocAllocator<MemStatsLiveBlock>{}.deallocate(old_blocks, old_capacity);
+        }
+    };
+
+    Shard shards[shard_count];
+
+    static std::uint64_t hash(const void *ptr)
+    {
+        // finalizer of MurmurHash3, pointers are aligned and clustered so low bits alone are a bad hash
+        std::uint64_t key = std::uint64_t(reinterpret_cast<std::uintptr_t>(ptr));
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key;
+    }
+
+    Shard &shard(const void *ptr)
+    {
+        return shards[hash(ptr) % shard_count];
+    }
+
+public:
+    /** Inserts a live block
+     * A block with the same address is replaced, after calling 'release' with it while its shard is still locked.
+     * This happens when its deallocation was not seen, e.g. it was freed by other means than 'delete'.
+     */
+    template <class Release>
+    void insert(const MemStatsLiveBlock &block, Release release)
+    {
+        Shard &s = shard(block.ptr);
+        s.lock();
+        if (2 * (s.size + 1) > s.capacity)
+            s.grow();
+        std::size_t i = s.home(block.ptr);
+        while (s.blocks[i].ptr and s.blocks[i].ptr != block.ptr)
+            i = (i + 1) & (s.capacity - 1);
+        if (s.blocks[i].ptr)
+            release(s.blocks[i]);
+        else
+            ++s.size;
+        s.blocks[i] = block;
+        s.unlock();
+    }
+
+    /** Removes the live block at 'ptr'
+     * @return Whether the block was found, in which case 'release' is called with it while its shard is still locked
+     * and it is moved into 'erased'.
+     */
+    template <class Release>
+    bool erase(const void *ptr, MemStatsLiveBlock &erased, Release release)
+    {
+        Shard &s = shard(ptr);
+        s.lock();
+        if (not s.size)
+        {
+            s.unlock();
+            return false;
+        }
+        const std::size_t mask = s.capacity - 1;
+        std::size_t i = s.home(ptr);
+        while (s.blocks[i].ptr and s.blocks[i].ptr != ptr)
+            i = (i + 1) & mask;
+        const bool found = s.blocks[i].ptr;
+        if (found)
+        {
+            erased = s.blocks[i];
+            release(erased);
+            --s.size;
+            // backward shift deletion: move up the following blocks that are not at their home position
+            for (std::size_t j = (i + 1) & mask; s.blocks[j].ptr; j = (j + 1) & mask)
+            {
+                std::size_t k = s.home(s.blocks[j].ptr);
+                if ((j > i and (k <= i or k > j)) or (j < i and (k <= i and k > j)))
+                {
+                    s.blocks[i] = s.blocks[j];
+                    i = j;
+                }
+            }
+            s.blocks[i] = MemStatsLiveBlock{};
+        }
+        s.unlock();
+        return found;
+    }
+
+    template <class F>
+    void for_each(F f)
+    {
+        for (Shard &s : shards)
+        {
+            s.lock();
+            for (std::size_t i = 0; i != s.capacity; ++i)
+                if (s.blocks[i].ptr)
+                    f(s.blocks[i]);
+            s.unlock();
+        }
+    }
+
+    // calls 'f' with every shard locked, so that no block is released meanwhile
+    template <class F>
+    void exclusive(F f)
+    {
+        for (Shard &s : shards)
+            s.lock();
+        f();
+        for (Shard &s : shards)
+            s.unlock();
+    }
+};
+
+#if MEMSTAT_HAVE_STACKTRACE
+#if MEMSTATS_HAVE_STACKTRACE_ENTRY_LAYOUT
+// frame of a stacktrace from the address of its call instruction, as 'stacktrace::current' would give it
+inline std::stacktrace_entry memstats_stacktrace_entry(std::uintptr_t address)
+{
+    // entries can only be made by 'std::basic_stacktrace', but in these versions they hold nothing more than their native handle
+    static_assert(sizeof(std::stacktrace_entry) == sizeof(std::stacktrace_entry::native_handle_type) and
+                  std::is_trivially_copyable<std::stacktrace_entry>::value, "Stacktrace entries are expected to be a native handle");
+    const std::stacktrace_entry::native_handle_type handle = address;
+    std::stacktrace_entry entry;
+    std::memcpy(static_cast<void *>(&entry), &handle, sizeof handle);
+    return entry;
+}
+#endif
+
+// frames of a stacktrace of 'memstats_stacks'
+struct MemStatsStackEntries
+{
+    const std::stacktrace_entry *first, *last;
+
+    const std::stacktrace_entry *begin() const { return first; }
+    const std::stacktrace_entry *end() const { return last; }
+};
+
+// addresses of the call instructions of a stacktrace, hashed while they are collected
+struct MemStatsFrames
+{
+    static constexpr std::size_t capacity = 128;
+
+    std::size_t size;
+    std::uint64_t hash;
+    std::uintptr_t addresses[capacity];
+
+    void clear()
+    {
+        size = 0;
+        hash = 0xcbf29ce484222325ULL;
+    }
+
+    void push(std::uintptr_t address)
+    {
+        // finalizer of MurmurHash3 on each address, combined as in FNV-1a
+        std::uint64_t key = address;
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        hash = (hash ^ key) * 0x100000001b3ULL;
+        addresses[size++] = address;
+    }
+};
+
+/** Unique stacktraces of the recorded events, identified by their position in the table plus one.
+ * Stacktraces are looked up by their raw return addresses, whose hash selects a shard of the index, each one an
+ * open-addressing table guarded by its own spin lock, so threads interning concurrently rarely contend.
+ * Stacktraces not seen before keep their addresses, to be matched, and their frames as 'std::stacktrace_entry', which are
+ * symbolized when reported.
+ * Stacktraces are stored in chunks that never move, so they can be read without lock once their id is known.
+ * It is const-initialized and never destroyed, so it can be used at any point of the program.
+ */
+class MemStatsStackTable
+{
+    static constexpr std::size_t shard_count = 64;
+    static constexpr std::size_t chunk_size = 4096;
+    static constexpr std::size_t chunk_count = 1024;
+
+    struct Slot
+    {
+        std::uint64_t hash;
+        // 0 for empty slots
+        std::uint32_t id;
+    };
+
+    struct alignas(64) Shard : MemStatsSpinLock
+    {
+        Slot *slots = nullptr;
+        std::size_t capacity = 0, size = 0;
+
+        std::size_t home(std::uint64_t hash) const
+        {
+            return (hash / shard_count) & (capacity - 1);
+        }
+
+        void grow()
+        {
+            Slot *old_slots = slots;
+            std::size_t old_capacity = capacity;
+            capacity = capacity ? 2 * capacity : 64;
+            slots = MallocAllocator<Slot>{}.allocate(capacity);
+            for (std::size_t i = 0; i != capacity; ++i)
+                slots[i] = Slot{0, 0};
+            for (std::size_t i = 0; i != old_capacity; ++i)
+                if (old_slots[i].id)
+                {
+                    std::size_t j = home(old_slots[i].hash);
+                    while (slots[j].id)
+                        j = (j + 1) & (capacity - 1);
+                    slots[j] = old_slots[i];
+                }
+            if (old_slots)
+                MallocAllocator<Slot>{}.deallocate(old_slots, old_capacity);
+        }
+    };
+
+    struct Stack
+    {
+        std::uintptr_t *addresses;
+        std::size_t depth;
+        std::stacktrace_entry *entries;
+        std::size_t entry_count;
+    };
+
+    Shard shards[shard_count];
+    std::atomic<Stack *> chunks[chunk_count] = {};
+    std::atomic<std::uint32_t> size{0};
+
+    const Stack &stack(std::uint32_t id) const
+    {
+        --id;
+        return chunks[id / chunk_size].load(std::memory_order_acquire)[id % chunk_size];
+    }
+
+    Stack *chunk(std::size_t index)
+    {
+        Stack *chunk = chunks[index].load(std::memory_order_acquire);
+        if (not chunk)
+        {
+            Stack *allocated = MallocAllocator<Stack>{}.allocate(chunk_size);
+            if (chunks[index].compare_exchange_strong(chunk, allocated, std::memory_order_acq_rel, std::memory_order_acquire))
+                chunk = allocated;
+            else
+                MallocAllocator<Stack>{}.deallocate(allocated, chunk_size);
+        }
+        return chunk;
+    }
+
+    // slot of 'frames' in a non-empty shard, or the empty slot where it belongs
+    std::size_t probe(const Shard &s, const MemStatsFrames &frames) const
+    {
+        std::size_t i = s.home(frames.hash);
+        for (; s.slots[i].id; i = (i + 1) & (s.capacity - 1))
+        {
+            if (s.slots[i].hash != frames.hash)
+                continue;
+            const Stack &candidate = stack(s.slots[i].id);
+            if (candidate.depth == frames.size and std::equal(frames.addresses, frames.addresses + frames.size, candidate.addresses))
+                break;
+        }
+        return i;
+    }
+
+public:
+    // id of 'frames', 0 if not interned yet
+    std::uint32_t find(const MemStatsFrames &frames)
+    {
+        Shard &s = shards[frames.hash % shard_count];
+        std::lock_guard<MemStatsSpinLock> lock{s};
+        return s.capacity ? s.slots[probe(s, frames)].id : 0;
+    }
+
+    // id of 'frames', interned with the range of stacktrace entries 'frames_entries' if not seen before; 0 if the table is full
+    template <typename Entries>
+    std::uint32_t insert(const MemStatsFrames &frames, const Entries &frames_entries)
+    {
+        Shard &s = shards[frames.hash % shard_count];
+        std::lock_guard<MemStatsSpinLock> lock{s};
+        if (2 * (s.size + 1) > s.capacity)
+            s.grow();
+        const std::size_t i = probe(s, frames);
+        if (s.slots[i].id)
+            return s.slots[i].id;
+        // 'size' stops at the capacity, so that it never wraps around onto the ids given before
+        std::uint32_t index = size.load(std::memory_order_relaxed);
+        do
+            if (index >= chunk_size * chunk_count)
+                return 0;
+        while (not size.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+        std::uintptr_t *addresses = MallocAllocator<std::uintptr_t>{}.allocate(std::max<std::size_t>(frames.size, 1));
+        std::copy(frames.addresses, frames.addresses + frames.size, addresses);
+        const std::size_t entry_count = std::distance(std::begin(frames_entries), std::end(frames_entries));
+        std::stacktrace_entry *entries = MallocAllocator<std::stacktrace_entry>{}.allocate(std::max<std::size_t>(entry_count, 1));
+        std::uninitialized_copy(std::begin(frames_entries), std::end(frames_entries), entries);
+        ::new (chunk(index / chunk_size) + index % chunk_size) Stack{addresses, frames.size, entries, entry_count};
+        s.slots[i] = Slot{frames.hash, index + 1};
+        ++s.size;
+        return index + 1;
+    }
+
+    // frames of the stacktrace of a non-zero id
+    MemStatsStackEntries operator[](std::uint32_t id) const
+    {
+        const Stack &found = stack(id);
+        return MemStatsStackEntries{found.entries, found.entries + found.entry_count};
+    }
+};
+#endif
+
+// node of the tree of regions, see 'MemStatsRegionTable'
+struct MemStatsRegionNode
+{
+    std::uint32_t parent;
+    string name;
+};
+
+/** Named regions opened with 'memstats_region_begin'.
+ * Regions form a tree: a name opened within different regions gives different nodes, so that nested regions can be rolled
+ * up into the regions enclosing them. Ids index the nodes, with 0 being the root, i.e. no region. Nodes are never removed.
+ * It is const-initialized and its storage is allocated with the first region, so regions can be opened at any point of the program.
+ */
+class MemStatsRegionTable
+{
+    struct Storage
+    {
+        vector<MemStatsRegionNode> nodes;
+        // id of the nodes by the hash of their parent and name, collisions are moved to the next hash
+        unordered_map<std::uint64_t, std::uint32_t> ids;
+    };
+
+    MemStatsSpinLock lock;
+    Storage *storage = nullptr;
+
+public:
+    // id of the region 'name' nested in 'parent', created on its first use
+    std::uint32_t find_or_insert(std::uint32_t parent, const char *name)
+    {
+        std::uint64_t hash = 14695981039346656037ULL ^ parent;
+        for (const char *c = name; *c; ++c)
+            hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ULL;
+        std::lock_guard<MemStatsSpinLock> guard{lock};
+        if (not storage)
+        {
+            storage = ::new (MallocAllocator<Storage>{}.allocate(1)) Storage;
+            storage->nodes.push_back(MemStatsRegionNode{0, string()});
+        }
+        for (;; ++hash)
+        {
+            auto it = storage->ids.emplace(hash, std::uint32_t(storage->nodes.size()));
+            if (it.second)
+            {
+                storage->nodes.push_back(MemStatsRegionNode{parent, string(name)});
+                return it.first->second;
+            }
+            const MemStatsRegionNode &node = storage->nodes[it.first->second];
+            if (node.parent == parent and node.name == name)
+                return it.first->second;
+        }
+    }
+
+    // node of an existing id
+    MemStatsRegionNode node(std::uint32_t id)
+    {
+        std::lock_guard<MemStatsSpinLock> guard{lock};
+        return storage->nodes[id];
+    }
+
+    // copy of all the nodes, starting with the root
+    vector<MemStatsRegionNode> nodes()
+    {
+        std::lock_guard<MemStatsSpinLock> guard{lock};
+        return storage ? storage->nodes : vector<MemStatsRegionNode>(1, MemStatsRegionNode{0, string()});
+    }
+};
+
+/** Allocations made within no-alloc scopes, kept until the next report.
+ * Writers claim a slot with a single atomic increment and publish it with its sequence number, so logging never blocks
+ * nor allocates. When the ring is full, the oldest entries are overwritten. Entries being overwritten while read are skipped.
+ */
+class MemStatsNoAllocRing
+{
+public:
+    static constexpr std::size_t capacity = 256;
+
+private:
+    struct Entry
+    {
+        // '2 * (index + 1)' once written, odd while being written
+        std::atomic<std::size_t> sequence{0};
+        std::atomic<const char *> scope{nullptr};
+        std::atomic<std::size_t> size{0};
+        std::atomic<std::uint32_t> stack{0};
+    };
+
+    std::atomic<std::size_t> head{0};
+    Entry entries[capacity];
+
+public:
+    void push(const char *scope, std::size_t size, std::uint32_t stack)
+    {
+        const std::size_t index = head.fetch_add(1, std::memory_order_relaxed);
+        Entry &entry = entries[index % capacity];
+        entry.sequence.store(2 * index + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        entry.scope.store(scope, std::memory_order_relaxed);
+        entry.size.store(size, std::memory_order_relaxed);
+        entry.stack.store(stack, std::memory_order_relaxed);
+        entry.sequence.store(2 * index + 2, std::memory_order_release);
+    }
+
+    // calls 'f' with the entries pushed from the index 'first' on that are still in the ring, returns the next index
+    template <class F>
+    std::size_t for_each(std::size_t first, F f) const
+    {
+        const std::size_t last = head.load(std::memory_order_acquire);
+        for (std::size_t index = std::max(first, last > capacity ? last - capacity : 0); index < last; ++index)
+        {
+            const Entry &entry = entries[index % capacity];
+            const std::size_t sequence = entry.sequence.load(std::memory_order_acquire);
+            const char *scope = entry.scope.load(std::memory_order_relaxed);
+            const std::size_t size = entry.size.load(std::memory_order_relaxed);
+            const std::uint32_t stack = entry.stack.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence == 2 * index + 2 and entry.sequence.load(std::memory_order_relaxed) == sequence)
+                f(scope, size, stack);
+        }
+        return last;
+    }
+};
+
+/** NOTE: initialization order fiasco on the sight!
+ * The operator 'new' and 'delete' are automatically exposed to the whole program and
+ * dynamic-initializtion of other global variables may be interleaved with the ones defined here.
+ * This means that another translation unit may try to use 'new' or 'delete' during its static
+ * initialization/destruction phase and may end up triggering an undefined behavior on this one.
+ * Therefore, we need to reason about the order of initialization of global variables here with
+ * respect to global variables in other libraries. Three key points help us to get this right:
+ * (i) 'new'/'delete' cannot be used during constant- and zero-initialization, but on dynamic- and automatic-initialization phases.
+ * (ii) dynamic-initialization of the variables in this translation unit happen in the order they appear here.
+ * (iii) Calls to std::atexit(...) happen in reverse order as they are invoked.
+ */
+
+static std::recursive_mutex memstats_lock = {};
+
+// Lock of the statistics drained from the thread buffers, taken on its own by the drain thread, or within 'memstats_lock'
+static std::recursive_mutex memstats_drained_lock = {};
+
+// Lock of the trace file, taken on its own by threads writing out their events, or within 'memstats_lock'
+static std::mutex memstats_trace_mutex;
+
+// Head of the registry of thread buffers. Being const-initialized, threads may register themselves
+// at any point of the dynamic-initialization without having to care about its order.
+MEMSTATS_CONSTINIT static std::atomic<MemStatsThread *> memstats_threads{nullptr};
+
+// Number of chunks started so far when tracing. Read by reports before taking a thread, so that the trace tells apart the
+// chunks the report took from the ones the thread started afterwards and may write out before the end of the report.
+MEMSTATS_CONSTINIT static std::atomic<std::uint64_t> memstats_chunk_sequence{0};
+
+// Counters of all the threads that exited summed up, their buffers are reused by other threads
+MEMSTATS_CONSTINIT static MemStatsCounters memstats_exited_counters = {};
+
+// Live allocations, only filled when 'memstats_track_live' is enabled
+MEMSTATS_CONSTINIT static MemStatsLiveTable memstats_live_table = {};
+MEMSTATS_CONSTINIT static std::atomic<std::size_t> memstats_live_bytes{0};
+MEMSTATS_CONSTINIT static std::atomic<std::size_t> memstats_peak_bytes{0};
+
+#if MEMSTAT_HAVE_STACKTRACE
+// Stacktraces referred to by the recorded events and live blocks
+MEMSTATS_CONSTINIT static MemStatsStackTable memstats_stacks = {};
+#endif
+
+// Regions opened by any thread
+MEMSTATS_CONSTINIT static MemStatsRegionTable memstats_regions = {};
+
+// Buffer of the calling thread, registered on its first recorded event
+static thread_local MemStatsThread *memstats_thread_events = nullptr;
+
+// Regions opened by the calling thread, innermost last. Regions nested deeper than 'memstats_region_capacity' are
+// attributed to the deepest one tracked. Trivially initialized, so that they can be accessed at any point.
+static constexpr std::size_t memstats_region_capacity = 32;
+static thread_local std::uint32_t memstats_region_stack[memstats_region_capacity];
+static thread_local std::size_t memstats_region_depth = 0;
+
+// Allocations made within no-alloc scopes by any thread, the ones not aborting the program are logged into the ring
+MEMSTATS_CONSTINIT static MemStatsNoAllocRing memstats_noalloc_ring = {};
+// index of the first entry of the ring not reported yet, only accessed under 'memstats_lock'
+MEMSTATS_CONSTINIT static std::size_t memstats_noalloc_reported = 0;
+
+// No-alloc scopes opened by the calling thread with their names and the number of allocations made on this thread when opened.
+// Same capacity and initialization reasoning as the regions.
+static thread_local const char *memstats_noalloc_scope[memstats_region_capacity];
+static thread_local std::size_t memstats_noalloc_start[memstats_region_capacity];
+static thread_local std::size_t memstats_noalloc_depth = 0;
+// allocations made by the calling thread within no-alloc scopes
+static thread_local std::size_t memstats_noalloc_count = 0;
+
+// innermost region tracked by the calling thread, 0 when none
+std::uint32_t memstats_current_region()
+{
+    const std::size_t depth = std::min(memstats_region_depth, memstats_region_capacity);
+    return depth ? memstats_region_stack[depth - 1] : 0;
+}
+
+void *memstats_aligned_malloc(std::size_t sz, std::size_t alignment);
+
+// Zero- and dynamic-initialization of a thread-local variable does not necessarily happen on any order related to the global ones
+static thread_local bool memstats_instrumentation_thread = init_memstats_instrumentation_thread();
+
+// Whether the calling thread is executing memstats itself, e.g. recording or reporting.
+// Allocations made meanwhile (by the C++ or C library) are not instrumented, otherwise they would recurse into the instrumentation.
+// Trivially initialized, so that it can be accessed at any point, even from within 'malloc'.
+static thread_local bool memstats_thread_busy = false;
+
+struct MemStatsBusyGuard
+{
+    const bool busy = memstats_thread_busy;
+    MemStatsBusyGuard() { memstats_thread_busy = true; }
+    ~MemStatsBusyGuard() { memstats_thread_busy = busy; }
+};
+
+// Whether the calling thread already retired its buffer, later events of the thread are not instrumented.
+// Trivially initialized, so that it can be accessed at any point.
+static thread_local bool memstats_thread_exited = false;
+
+// Thread that runs the dynamic-initialization. Its thread-local variables are destroyed before the report at exit,
+// so it keeps its buffer until then.
+static const std::thread::id memstats_main_thread = std::this_thread::get_id();
+
+// hands the buffer of the calling thread over to the next report, the thread does not record anymore
+void memstats_retire_thread()
+{
+    if (std::this_thread::get_id() == memstats_main_thread)
+        return;
+    memstats_thread_exited = true;
+    MemStatsThread *thread_events = memstats_thread_events;
+    if (not thread_events)
+        return;
+    memstats_thread_events = nullptr;
+    thread_events->counters.thread.store(0, std::memory_order_release);
+    memstats_exited_counters.merge(thread_events->counters);
+    // its live blocks stay attributed to its id, but stop counting for the next thread of the buffer
+    memstats_live_table.exclusive([&]
+    {
+        ++thread_events->generation;
+        thread_events->live_bytes.store(0, std::memory_order_relaxed);
+        thread_events->peak_bytes.store(0, std::memory_order_relaxed);
+    });
+    thread_events->state.store(MemStatsThread::retired, std::memory_order_release);
+}
+
+// Retires the buffer of its thread when destroyed at thread exit, constructed at the latest when the buffer is registered
+struct MemStatsThreadExit
+{
+    ~MemStatsThreadExit() { memstats_retire_thread(); }
+};
+static thread_local MemStatsThreadExit memstats_thread_exit;
+
+MemStatsThread *memstats_register_thread()
+{
+    // allocations made meanwhile (e.g. to register the thread exit hook) must not recurse into the registration
+    const MemStatsBusyGuard busy;
+    MemStatsThread *thread_events = nullptr;
+    // buffers of exited threads already reported are reused
+    for (MemStatsThread *candidate = memstats_threads.load(std::memory_order_acquire); candidate; candidate = candidate->next)
+    {
+        unsigned char vacant = MemStatsThread::vacant;
+        if (candidate->state.load(std::memory_order_relaxed) == vacant
+            and candidate->state.compare_exchange_strong(vacant, MemStatsThread::claimed, std::memory_order_acquire, std::memory_order_relaxed))
+        {
+            thread_events = candidate;
+            thread_events->counters.reset();
+            break;
+        }
+    }
+    if (not thread_events)
+    {
+        // over-aligned for its counters, it is never deallocated
+        void *storage = memstats_aligned_malloc(sizeof(MemStatsThread), alignof(MemStatsThread));
+        if (not storage)
+            throw std::bad_alloc{};
+        thread_events = ::new (storage) MemStatsThread;
+        thread_events->state.store(MemStatsThread::claimed, std::memory_order_relaxed);
+        thread_events->next = memstats_threads.load(std::memory_order_relaxed);
+        while (not memstats_threads.compare_exchange_weak(thread_events->next, thread_events, std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+    thread_events->thread = std::this_thread::get_id();
+    thread_events->counters.thread.store(std::hash<std::thread::id>{}(thread_events->thread), std::memory_order_release);
+    thread_events->state.store(MemStatsThread::active, std::memory_order_release);
+    static_cast<void>(memstats_thread_exit);
+    return thread_events;
+}
+
+// counters of the calling thread, its buffer is registered on first use
+MemStatsCounters &memstats_own_counters()
+{
+    if (not memstats_thread_events)
+        memstats_thread_events = memstats_register_thread();
+    return memstats_thread_events->counters;
+}
+
+// guard thread-local variable to instrument further delets at exit
+bool init_memstats_instrumentation_thread_guard()
+{
+    std::atexit([]{ memstats_instrumentation_thread = false; });
+    return true;
+}
+const static thread_local bool memstats_instrumentation_thread_guard = init_memstats_instrumentation_thread_guard();
+
+// Whether events are aggregated directly on record instead of being stored until the next report.
+// Zero-initialized to 'false' and set before 'memstats_instrumentation_global' is enabled, events recorded
+// before are stored and folded at report time, so both modes may be mixed safely.
+static const bool memstats_stream_aggregation = memstats_env_bool("MEMSTATS_STREAM_AGGREGATION", false);
+
+std::size_t init_memstats_sample_interval()
+{
+    if (const char *ptr = std::getenv("MEMSTATS_SAMPLE_INTERVAL"))
+    {
+        try
+        {
+            return std::stoull(ptr);
+        }
+        catch (...)
+        {
+            std::cerr << "Option 'MEMSTATS_SAMPLE_INTERVAL=" << ptr << "' not known. Fallback on default '0'\n";
+        }
+    }
+    return 0;
+}
+
+// Mean number of bytes between sampled allocations, '0' records every allocation.
+// Same initialization reasoning as 'memstats_stream_aggregation': events recorded before its initialization are just not sampled.
+static const std::size_t memstats_sample_interval = init_memstats_sample_interval();
+
+// Whether the allocations never deallocated are reported at exit, it implies 'memstats_track_live'.
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const bool memstats_leak_report = memstats_env_bool("MEMSTATS_LEAK_REPORT", false);
+
+// Whether the lifetime of blocks, from their allocation to their deallocation, is measured. It implies 'memstats_track_live'.
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const bool memstats_lifetime = memstats_env_bool("MEMSTATS_LIFETIME", false);
+
+// Whether allocations are matched with their deallocations to track the live heap.
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const bool memstats_track_live = memstats_env_bool("MEMSTATS_TRACK_LIVE", false) or memstats_leak_report or memstats_lifetime;
+
+// Whether the time spent in 'malloc'/'free' by the 'new'/'delete' operators is measured.
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const bool memstats_latency = memstats_env_bool("MEMSTATS_LATENCY", false);
+
+// Whether reports draw the events over time, folded events are added to the series of their aggregate.
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const bool memstats_timeline = memstats_env_bool("MEMSTATS_TIMELINE", false);
+
+// Whether reports fold the stored events on worker threads, see 'memstats_fold_all'.
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const bool memstats_parallel_fold = memstats_env_bool("MEMSTATS_PARALLEL_FOLD", false);
+
+bool init_memstats_noalloc_abort()
+{
+    if (const char *ptr = std::getenv("MEMSTATS_NOALLOC"))
+    {
+        if (std::strcmp(ptr, "abort") == 0)
+            return true;
+        if (std::strcmp(ptr, "log") != 0)
+            std::cerr << "Option 'MEMSTATS_NOALLOC=" << ptr << "' not known. Fallback on default 'log'\n";
+    }
+    return false;
+}
+
+// Whether allocations within no-alloc scopes abort the program instead of being logged.
+// Same initialization reasoning as 'memstats_stream_aggregation': allocations before its initialization are logged.
+static const bool memstats_noalloc_abort = init_memstats_noalloc_abort();
+
+std::size_t init_memstats_drain_interval()
+{
+    if (const char *ptr = std::getenv("MEMSTATS_DRAIN_INTERVAL"))
+    {
+        try
+        {
+            return std::stoull(ptr);
+        }
+        catch (...)
+        {
+            std::cerr << "Option 'MEMSTATS_DRAIN_INTERVAL=" << ptr << "' not known. Fallback on default '0'\n";
+        }
+    }
+    return 0;
+}
+
+// Milliseconds between the wake-ups of the background thread draining full event chunks, '0' for no drain thread.
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const std::size_t memstats_drain_interval = init_memstats_drain_interval();
+
+#if MEMSTAT_HAVE_STACKTRACE
+std::size_t init_memstats_stack_depth()
+{
+    if (const char *ptr = std::getenv("MEMSTATS_STACK_DEPTH"))
+    {
+        try
+        {
+            return std::min<std::size_t>(std::stoull(ptr), MemStatsFrames::capacity);
+        }
+        catch (...)
+        {
+            std::cerr << "Option 'MEMSTATS_STACK_DEPTH=" << ptr << "' not known. Fallback on default '64'\n";
+        }
+    }
+    return 64;
+}
+
+// Maximum number of frames of the recorded stacktraces, at most 'MemStatsFrames::capacity'.
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const std::size_t memstats_stack_depth = init_memstats_stack_depth();
+#endif
+
+// Path of the binary trace file where events are written to, 'nullptr' when events are not traced.
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const char *const memstats_trace_path = std::getenv("MEMSTATS_TRACE_FILE");
+
+// Source of the event timestamps
+enum class MemStatsClock : unsigned char
+{
+    chrono, // std::chrono::high_resolution_clock
+    tsc,    // raw time-stamp counter of the CPU, calibrated against std::chrono::steady_clock
+    coarse, // CLOCK_MONOTONIC_COARSE, cheap but with the resolution of the scheduler tick
+    none    // no timestamps
+};
+
+// reference points of the calibration of the time-stamp counter
+static std::int64_t memstats_tsc_reference = 0;
+static std::chrono::steady_clock::time_point memstats_steady_reference = {};
+
+inline std::int64_t memstats_tsc()
+{
+#if MEMSTATS_HAVE_TSC && defined(__aarch64__)
+    std::uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    return std::int64_t(ticks);
+#elif MEMSTATS_HAVE_TSC
+    return std::int64_t(__rdtsc());
+#else
+    return 0;
+#endif
+}
+
+MemStatsClock memstats_env_clock()
+{
+    if (const char *ptr = std::getenv("MEMSTATS_CLOCK"))
+    {
+        if (std::strcmp(ptr, "chrono") == 0)
+            return MemStatsClock::chrono;
+        if (std::strcmp(ptr, "none") == 0)
+            return MemStatsClock::none;
+        if (std::strcmp(ptr, "tsc") == 0)
+        {
+#if MEMSTATS_HAVE_TSC
+            memstats_steady_reference = std::chrono::steady_clock::now();
+            memstats_tsc_reference = memstats_tsc();
+            return MemStatsClock::tsc;
+#endif
+        }
+        else if (std::strcmp(ptr, "coarse") == 0)
+        {
+#ifdef CLOCK_MONOTONIC_COARSE
+            return MemStatsClock::coarse;
+#endif
+        }
+        std::cerr << "Option 'MEMSTATS_CLOCK=" << ptr << "' not known. Fallback on default 'chrono'\n";
+    }
+    return MemStatsClock::chrono;
+}
+
+MemStatsClock init_memstats_clock()
+{
+    const MemStatsClock clock = memstats_env_clock();
+    // Timestamps are only read by the timeline, traces, lifetimes and latencies. Otherwise events are not timestamped,
+    // reading the default clock would cost about as much as the rest of the recording.
+    return memstats_timeline or memstats_trace_path or memstats_lifetime or memstats_latency ? clock : MemStatsClock::none;
+}
+
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const MemStatsClock memstats_clock = init_memstats_clock();
+
+inline std::int64_t memstats_now()
+{
+    switch (memstats_clock)
+    {
+    case MemStatsClock::tsc:
+        return memstats_tsc();
+#ifdef CLOCK_MONOTONIC_COARSE
+    case MemStatsClock::coarse:
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+        return std::int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+    }
+#endif
+    case MemStatsClock::none:
+        return 0;
+    default:
+        return std::chrono::high_resolution_clock::now().time_since_epoch().count();
+    }
+}
+
+// seconds per tick of 'memstats_now', 0 when there are no timestamps
+double memstats_tick_seconds()
+{
+    switch (memstats_clock)
+    {
+    case MemStatsClock::tsc:
+    {
+        // the longer the program runs, the more accurate the calibration gets
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - memstats_steady_reference).count();
+        const std::int64_t ticks = memstats_tsc() - memstats_tsc_reference;
+        return ticks > 0 ? seconds / double(ticks) : 0.;
+    }
+    case MemStatsClock::coarse:
+        return 1e-9;
+    case MemStatsClock::none:
+        return 0.;
+    default:
+        return double(std::chrono::high_resolution_clock::period::num) / double(std::chrono::high_resolution_clock::period::den);
+    }
+}
+
+#if MEMSTAT_PRELOAD
+// Path prefix of the files where the reports of each process are written to, 'nullptr' to write them to the standard error.
+// Same initialization reasoning as 'memstats_stream_aggregation'.
+static const char *const memstats_report_path = std::getenv("MEMSTATS_REPORT_FILE");
+// Standard error duplicated before 'main', programs closing their standard streams at exit (e.g. coreutils) would
+// otherwise silence the report at exit
+static const int memstats_stderr_fd = ::fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 0);
+#endif
+
+// We need to make absolutely sure this is constinit so that 'memstats_instrumentation_global' is const-initialized,
+// otherwise threads will try to syncronize with an uninitialized variable
+#if MEMSTAT_ATOMIC_CONSTEXPR
+MEMSTATS_CONSTINIT static std::atomic<bool> memstats_instrumentation_global{false};
+#else
+#error "MemStats needs a conforming C++ standard library where 'std::atomic<bool>' can be const-initialized, i.e. its constructor is 'constexpr'!"
+#endif
+
+bool init_memstats_instrumentation_guard()
+{
+    // Note this variable is const-initialized to false. Here we change it to true and syncronize other threads during dynamic initialization
+    bool instrument = memstats_env_bool("MEMSTATS_ENABLE_INSTRUMENTATION", false);
+    memstats_instrumentation_global.store(instrument, std::memory_order_release);
+    return instrument;
+}
+
+// Const-initialization (happens before dynamic-initialization) assigns 'false' to 'memstats_instrumentation_global' which is fine because no instrumentation will be done, and 'memstats_threads' won't be called.
+// By defining 'memstats_instrumentation_global' after 'memstats_lock' we guarantee that they are initialized on that order during dynamic-initialization.
+// meaning that we cannot register memory events before 'memstats_lock' is initialized.
+// Note that we do not want this variable to be const-initialized to 'true' before dynamic-initialization, so we make sure this gets
+// dynamic-initialized in the correct order by delaying its initialization by a non-constexpr function.
+static bool memstats_instrumentation_guard = init_memstats_instrumentation_guard();
+
+// writes the stored events of all threads to the trace file, if any
+void memstats_trace_sync();
+// folds the chunks handed over to the drain thread
+void memstats_drain_all();
+// reports the allocations that are still live
+void memstats_report_leaks();
+
+bool init_memstats_at_exit()
+{
+    static std::once_flag report_flag;
+    std::call_once(report_flag,
+        []{ std::atexit([]{
+            memstats_instrumentation_global.store(false, std::memory_order_release);
+            bool do_report_at_exit = memstats_env_bool("MEMSTATS_REPORT_AT_EXIT", true);
+            if (do_report_at_exit)
+                memstats_report("default");
+            else
+                memstats_trace_sync();
+            if (memstats_leak_report)
+                memstats_report_leaks();
+        });
+    });
+    return true;
+}
+
+// Destruction order fiasco also hits here. If a variable destroyed during dynamic-initialization-destruction (reverse order),
+// calls on 'delete' may trigger an access to an already destroyed 'memstats_lock'.
+// Therefore, we make sure to make a 'report' before 'memstats_lock' is destroyed.
+// Thread buffers in 'memstats_threads' are never destroyed, so late events are recorded but never reported.
+static const bool memstats_at_exit_guard = init_memstats_at_exit();
+
+/** Overview of initialization/destruction order:
+ * memstats_instrumentation_global = false;                                                     // const-initialization
+ * memstats_threads = nullptr;                                                                  // const-initialization
+ * memstats_live_table = {};                                                                    // const-initialization
+ * memstats_stacks = {};                                                                        // const-initialization
+ * memstats_regions = {};                                                                       // const-initialization
+ * memstats_noalloc_ring = {};                                                                  // const-initialization
+ * memstats_exited_counters = {};                                                               // const-initialization
+ * memstats_membarrier = membarrier(...);                                                       // dynamic-initialization
+ * memstats_lock = {};                                                                          // dynamic-initialization
+ * memstats_drained_lock = {};                                                                  // dynamic-initialization
+ * memstats_main_thread = std::this_thread::get_id();                                           // dynamic-initialization
+ * memstats_stream_aggregation = getenv(...);                                                   // dynamic-initialization
+ * memstats_sample_interval = getenv(...);                                                      // dynamic-initialization
+ * memstats_leak_report = getenv(...);                                                          // dynamic-initialization
+ * memstats_lifetime = getenv(...);                                                             // dynamic-initialization
+ * memstats_track_live = getenv(...);                                                           // dynamic-initialization
+ * memstats_latency = getenv(...);                                                              // dynamic-initialization
+ * memstats_timeline = getenv(...);                                                             // dynamic-initialization
+ * memstats_parallel_fold = getenv(...);                                                        // dynamic-initialization
+ * memstats_noalloc_abort = getenv(...);                                                        // dynamic-initialization
+ * memstats_drain_interval = getenv(...);                                                       // dynamic-initialization
+ * memstats_stack_depth = getenv(...);                                                          // dynamic-initialization
+ * memstats_trace_path = getenv(...);                                                           // dynamic-initialization
+ * memstats_clock = getenv(...);                                                                // dynamic-initialization
+ * memstats_report_path = getenv(...); (memstats_preload only)                                   // dynamic-initialization
+ * memstats_stderr_fd = fcntl(...); (memstats_preload only)                                      // dynamic-initialization
+ * init_memstats_instrumentation_guard(); -> memstats_instrumentation_global = true;            // dynamic-initialization
+ * memstats_at_exit_guard = init_memstats_at_exit();                                    // dynamic-initialization
+ * memstats_drain_guard = init_memstats_drain(); -> start drain thread                          // dynamic-initialization
+ * main();
+ * stop and join drain thread                                                                   // dynamic-initialization-destruction
+ * memstats_instrumentation_global = false;
+ * std::atexit(default_report); -> read memstats_threads, memstats_live_table                   // dynamic-initialization-destruction
+ * memstats_drained_lock.~mutex();                                                              // dynamic-initialization-destruction
+ * memstats_lock.~mutex();                                                                      // dynamic-initialization-destruction
+ */
+
+// bin representation of percentage from 0% to 100%
+static const std::array<const char*,4> memstats_str_precentage_punctuation{" ", ".", ":", "!"};
+static const std::array<const char*,4> memstats_str_precentage_circle{" ", ".", "o", "O"};
+static const std::array<const char*,5> memstats_str_precentage_shadow{" ", "░", "▒", "▓", "█"};
+static const std::array<const char*,5> memstats_str_precentage_wire{" ", "-", "~", "=", "#"};
+static const std::array<const char*,9> memstats_str_precentage_box{" ", "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█"};
+static const std::array<const char*,10> memstats_str_precentage_number{"0", "1", "2", "3", "4", "5", "6", "7", "8", "9"};
+
+std::pair<char const * const *, std::size_t> memstats_str_hist_representation()
+{
+    if (const char *ptr = std::getenv("MEMSTATS_HISTOGRAM_REPRESENTATION"))
+    {
+        if (std::strcmp(ptr, "box") == 0)
+            return std::make_pair(memstats_str_precentage_box.data(), memstats_str_precentage_box.size());
+        if (std::strcmp(ptr, "number") == 0)
+            return std::make_pair(memstats_str_precentage_number.data(), memstats_str_precentage_number.size());
+        if (std::strcmp(ptr, "punctuation") == 0)
+            return std::make_pair(memstats_str_precentage_punctuation.data(), memstats_str_precentage_punctuation.size());
+        if (std::strcmp(ptr, "shadow") == 0)
+            return std::make_pair(memstats_str_precentage_shadow.data(), memstats_str_precentage_shadow.size());
+        if (std::strcmp(ptr, "wire") == 0)
+            return std::make_pair(memstats_str_precentage_wire.data(), memstats_str_precentage_wire.size());
+        if (std::strcmp(ptr, "circle") == 0)
+            return std::make_pair(memstats_str_precentage_circle.data(), memstats_str_precentage_circle.size());
+        std::cerr << "Option 'MEMSTATS_HISTOGRAM_REPRESENTATION=" << ptr << "' not known. Fallback on default 'box'\n";
+    }
+    return std::make_pair(memstats_str_precentage_box.data(), memstats_str_precentage_box.size());
+}
+
+unsigned short memstats_bins()
+{
+    if (const char *ptr = std::getenv("MEMSTATS_BINS"))
+    {
+        try
+        {
+            return std::stoi(ptr);
+        }
+        catch (...)
+        {
+            std::cerr << "Option 'MEMSTATS_BINS=" << ptr << "' not known. Fallback on default '15'\n";
+        }
+    }
+    return 15;
+}
+
+// blocks freed within this number of seconds are counted as short-lived by reports
+double memstats_lifetime_threshold()
+{
+    if (const char *ptr = std::getenv("MEMSTATS_LIFETIME_THRESHOLD"))
+    {
+        try
+        {
+            return std::stod(ptr) * 1e-6;
+        }
+        catch (...)
+        {
+            std::cerr << "Option 'MEMSTATS_LIFETIME_THRESHOLD=" << ptr << "' not known. Fallback on default '100'\n";
+        }
+    }
+    return 100e-6;
+}
+
+// maximum number of frames on a report, '0' for all of them
+std::size_t memstats_top_n()
+{
+    if (const char *ptr = std::getenv("MEMSTATS_TOP_N"))
+    {
+        try
+        {
+            return std::stoull(ptr);
+        }
+        catch (...)
+        {
+            std::cerr << "Option 'MEMSTATS_TOP_N=" << ptr << "' not known. Fallback on default '0'\n";
+        }
+    }
+    return 0;
+}
+
+// whether frames on a report are ranked by number of allocations instead of bytes
+bool memstats_rank_by_count()
+{
+    if (const char *ptr = std::getenv("MEMSTATS_RANK"))
+    {
+        if (std::strcmp(ptr, "count") == 0)
+            return true;
+        if (std::strcmp(ptr, "bytes") != 0)
+            std::cerr << "Option 'MEMSTATS_RANK=" << ptr << "' not known. Fallback on default 'bytes'\n";
+    }
+    return false;
+}
+
+// xorshift64* pseudo-random generator, cheap enough to be called on the allocation path
+inline std::uint64_t memstats_random(std::uint64_t &state)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+// uniform random number in (0, 1]
+inline double memstats_random_unit(std::uint64_t &state)
+{
+    return double((memstats_random(state) >> 11) + 1) / double(std::uint64_t{1} << 53);
+}
+
+/** Number of allocations represented by a sampled allocation of 'bytes'.
+ * An allocation of 'bytes' is sampled with probability p = 1 - exp(-bytes/interval), so each sample
+ * stands for 1/p allocations. It is randomly rounded to an integer to keep the estimate unbiased.
+ */
+std::size_t memstats_sample_weight(std::size_t bytes, std::size_t interval, std::uint64_t &state)
+{
+    if (not interval)
+        return 1;
+    const double weight = -1. / std::expm1(-double(bytes) / double(interval));
+    const double integral = std::floor(weight);
+    return std::size_t(integral) + (memstats_random_unit(state) <= weight - integral);
+}
+
+void MemStatsAggregate::add(const MemStatsInfo &info)
+{
+    const bool allocation = info.operation == MemStatsOperation::allocation;
+    if (allocation and not info.size)
+        return;
+    // deallocations are only recorded when not sampling
+    const std::size_t n = allocation ? memstats_sample_weight(info.size, memstats_sample_interval, random_state) : 1;
+    if (allocation)
+    {
+        stats.add(info.size, n, info.size_class);
+        if (info.region)
+            region_stats[info.region].add(info.size, n, info.size_class);
+#if MEMSTAT_HAVE_STACKTRACE
+        stack_stats[info.stack].add(info.size, n, info.size_class);
+#endif
+    }
+    if (memstats_timeline)
+        series.add(info.time, info.operation, info.size, n);
+    // untimed events, e.g. the C allocation functions, would drag the percentiles down to 0
+    if (info.timed)
+    {
+        latency.add(info.operation, info.latency, n);
+#if MEMSTAT_HAVE_STACKTRACE
+        stack_latency[info.stack].add(info.operation, info.latency, n);
+#endif
+    }
+    if (info.lifetime_weight)
+    {
+        lifetime.add(info.lifetime, info.lifetime_weight);
+#if MEMSTAT_HAVE_STACKTRACE
+        stack_lifetime[info.origin].add(info.lifetime, info.lifetime_weight);
+#endif
+    }
+}
+
+// removes the accounting of a block that is not live anymore, called with its shard of 'memstats_live_table' locked
+void memstats_release_live(const MemStatsLiveBlock &block)
+{
+    const std::size_t bytes = block.size * block.weight;
+    // the live bytes of an exited thread were dropped when its buffer was retired
+    if (block.generation == block.owner->generation)
+        block.owner->live_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+    memstats_live_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+void memstats_insert_live(const MemStatsInfo &info, MemStatsThread &owner)
+{
+    MemStatsLiveBlock block;
+    block.ptr = info.ptr;
+    block.size = info.size;
+    block.weight = memstats_sample_weight(info.size, memstats_sample_interval, owner.random_state);
+    block.owner = &owner;
+    block.thread = owner.thread;
+    block.stack = info.stack;
+    block.generation = owner.generation;
+    block.time = info.time;
+    memstats_live_table.insert(block, memstats_release_live);
+
+    // high-water marks: the owner is the only thread increasing its own live bytes
+    const std::size_t bytes = block.size * block.weight;
+    const std::size_t thread_live = owner.live_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    if (thread_live > owner.peak_bytes.load(std::memory_order_relaxed))
+        owner.peak_bytes.store(thread_live, std::memory_order_relaxed);
+    const std::size_t live = memstats_live_bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    std::size_t peak = memstats_peak_bytes.load(std::memory_order_relaxed);
+    while (live > peak and not memstats_peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed))
+        ;
+}
+
+// removes 'ptr' from the live allocations into 'block', returns the freed bytes if it was live, 0 otherwise
+std::size_t memstats_erase_live(void *ptr, MemStatsLiveBlock &block)
+{
+    if (not ptr or not memstats_live_bytes.load(std::memory_order_relaxed))
+        return 0;
+    if (not memstats_live_table.erase(ptr, block, memstats_release_live))
+        return 0;
+    return block.size;
+}
+
+// puts back a block removed by 'memstats_erase_live' that was not deallocated after all
+void memstats_restore_live(const MemStatsLiveBlock &block)
+{
+    memstats_live_table.insert(block, memstats_release_live);
+    const std::size_t bytes = block.size * block.weight;
+    memstats_live_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    // the owner may have exited meanwhile, its live bytes were dropped then
+    memstats_live_table.exclusive([&]
+    {
+        if (block.generation == block.owner->generation)
+            block.owner->live_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    });
+}
+
+#if MEMSTAT_HAVE_STACKTRACE
+#if MEMSTATS_HAVE_UNWIND
+struct MemStatsUnwind
+{
+    MemStatsFrames &frames;
+    std::size_t skip;
+    std::size_t depth;
+};
+
+_Unwind_Reason_Code memstats_unwind_frame(struct _Unwind_Context *context, void *arg)
+{
+    MemStatsUnwind &unwind = *static_cast<MemStatsUnwind *>(arg);
+    int before_instruction = 0;
+    std::uintptr_t address = _Unwind_GetIPInfo(context, &before_instruction);
+    if (not address or unwind.frames.size == unwind.depth)
+        return _URC_END_OF_STACK;
+    // as 'stacktrace::current' does, return addresses are moved back into their call instruction
+    if (not before_instruction)
+        --address;
+    if (unwind.skip)
+        --unwind.skip;
+    else
+        unwind.frames.push(address);
+    return _URC_NO_REASON;
+}
+#endif
+
+// Collects the frame addresses of the caller, skipping its 'skip' innermost frames. Unlike 'stacktrace::current', the
+// unwinder does not allocate nor symbolize, which is deferred until a stacktrace is reported.
+MEMSTATS_NOINLINE void memstats_capture_frames(MemStatsFrames &frames, std::size_t skip, std::size_t depth)
+{
+    frames.clear();
+#if MEMSTATS_HAVE_UNWIND
+    // the first frame unwound is this function
+    MemStatsUnwind unwind{frames, skip + 1, depth};
+    _Unwind_Backtrace(memstats_unwind_frame, &unwind);
+#else
+    for (const auto &entry : stacktrace::current(skip + 1, depth))
+        frames.push(std::uintptr_t(entry.native_handle()));
+#endif
+}
+#endif
+
+#if MEMSTAT_HAVE_STACKTRACE
+// id in 'memstats_stacks' of the stacktrace of the caller, skipping its 'skip' innermost frames
+MEMSTATS_NOINLINE std::uint32_t memstats_capture_stack(std::size_t skip)
+{
+    MemStatsFrames frames;
+    memstats_capture_frames(frames, skip + 1, memstats_stack_depth);
+    std::uint32_t id = memstats_stacks.find(frames);
+    if (id)
+        return id;
+#if MEMSTATS_HAVE_STACKTRACE_ENTRY_LAYOUT
+    std::stacktrace_entry entries[MemStatsFrames::capacity];
+    std::transform(frames.addresses, frames.addresses + frames.size, entries, memstats_stacktrace_entry);
+    return memstats_stacks.insert(frames, MemStatsStackEntries{entries, entries + frames.size});
+#else
+    // only stacktraces not seen before are unwound a second time
+    return memstats_stacks.insert(frames, stacktrace::current(skip + 1, memstats_stack_depth));
+#endif
+}
+#endif
+
+MEMSTATS_NOINLINE void MemStatsInfo::record(void *ptr, std::size_t sz, MemStatsOperation operation, std::size_t alignment, std::int64_t time,
+                                             bool timed, std::uint64_t latency, const MemStatsLiveBlock *freed)
+{
+    const MemStatsBusyGuard busy;
+    MemStatsInfo info;
+    info.ptr = ptr;
+    info.size = sz;
+    info.size_class = SizeHistogram::bucket(sz);
+    info.time = time;
+    info.operation = operation;
+    info.alignment = alignment;
+    info.latency = latency;
+    info.timed = timed;
+    info.region = memstats_current_region();
+    if (memstats_lifetime and freed)
+    {
+        info.lifetime = std::uint64_t(std::max<std::int64_t>(time - freed->time, 0));
+        info.origin = freed->stack;
+        info.lifetime_weight = freed->weight;
+    }
+#if MEMSTAT_HAVE_STACKTRACE
+    // skip 'record', 'memstats_new'/'memstats_delete' and the 'new'/'delete' operator
+    info.stack = memstats_capture_stack(3);
+#endif
+    if (not memstats_thread_events)
+        memstats_thread_events = memstats_register_thread();
+    if (memstats_track_live and operation == MemStatsOperation::allocation)
+        memstats_insert_live(info, *memstats_thread_events);
+    memstats_thread_events->begin_write();
+    if (memstats_stream_aggregation)
+        memstats_thread_events->aggregate().add(info);
+    else
+        memstats_thread_events->push(info);
+    memstats_thread_events->end_write();
+}
+
+// allocation of 'sz' bytes by a thread within a no-alloc scope, it is either logged or aborts the program
+MEMSTATS_NOINLINE void memstats_noalloc_violation(std::size_t sz)
+{
+    const MemStatsBusyGuard busy;
+    ++memstats_noalloc_count;
+    const char *scope = memstats_noalloc_scope[std::min(memstats_noalloc_depth, memstats_region_capacity) - 1];
+    std::uint32_t stack = 0;
+#if MEMSTAT_HAVE_STACKTRACE
+    // skip this function, 'memstats_new'/'memstats_record_malloc' and the 'new' operator/'malloc'
+    stack = memstats_capture_stack(3);
+#endif
+    if (not memstats_noalloc_abort)
+    {
+        memstats_noalloc_ring.push(scope, sz, stack);
+        return;
+    }
+    std::cerr << "MemStats: allocation of " << sz << " bytes within no-alloc scope '" << scope << "'\n";
+#if MEMSTAT_HAVE_STACKTRACE
+    if (stack)
+        for (const auto &entry : memstats_stacks[stack])
+            std::cerr << "        " << entry << '\n';
+#endif
+    std::abort();
+}
+
+// writes out the text of a report at once
+void memstats_write_output(const char *data, std::size_t size);
+
+/** Text of a report, formatted into one buffer that is written out at once.
+ * Numbers are formatted with integer arithmetic right into the buffer, so formatting neither allocates per value nor goes
+ * through streams. Values can be laid out in columns: 'column' marks the start of one, 'left'/'right' pad it to its width.
+ */
+class MemStatsFormatter
+{
+    vector<char> buffer;
+    std::size_t start = 0;
+
+    // SI prefixes of the values, up to the largest 'std::size_t'
+    static char prefix(unsigned base)
+    {
+        static const std::array<char, 7> metric_prefix{' ', 'k', 'M', 'G', 'T', 'P', 'E'};
+        return metric_prefix[base];
+    }
+
+public:
+    explicit MemStatsFormatter(std::size_t capacity = 0)
+    {
+        buffer.reserve(capacity);
+    }
+
+    MemStatsFormatter &operator<<(char c)
+    {
+        buffer.push_back(c);
+        return *this;
+    }
+
+    MemStatsFormatter &operator<<(const char *text)
+    {
+        buffer.insert(buffer.end(), text, text + std::strlen(text));
+        return *this;
+    }
+
+    template <class Allocator>
+    MemStatsFormatter &operator<<(const std::basic_string<char, std::char_traits<char>, Allocator> &text)
+    {
+        buffer.insert(buffer.end(), text.begin(), text.end());
+        return *this;
+    }
+
+    MemStatsFormatter &integer(std::size_t value)
+    {
+        char digits[std::numeric_limits<std::size_t>::digits10 + 1];
+        std::size_t n = 0;
+        do
+            digits[n++] = char('0' + value % 10);
+        while (value /= 10);
+        while (n)
+            buffer.push_back(digits[--n]);
+        return *this;
+    }
+
+    // 'value' in hexadecimal, prefixed with '0x'
+    MemStatsFormatter &hex(std::uint64_t value)
+    {
+        char digits[16];
+        std::size_t n = 0;
+        do
+            digits[n++] = "0123456789abcdef"[value % 16];
+        while (value /= 16);
+        buffer.push_back('0');
+        buffer.push_back('x');
+        while (n)
+            buffer.push_back(digits[--n]);
+        return *this;
+    }
+
+    // 'value' with 'precision' decimals
+    MemStatsFormatter &fixed(double value, int precision)
+    {
+        char text[32];
+        const int n = std::snprintf(text, sizeof text, "%.*f", precision, value);
+        buffer.insert(buffer.end(), text, text + std::max(0, std::min(n, int(sizeof text) - 1)));
+        return *this;
+    }
+
+    // 'value' divided by the largest power of 1000 below it, followed by its SI prefix
+    MemStatsFormatter &count(std::size_t value)
+    {
+        unsigned base = 0;
+        for (; value >= 1000; value /= 1000)
+            ++base;
+        return integer(value) << prefix(base);
+    }
+
+    // 'value' in the largest binary multiple of bytes below it
+    MemStatsFormatter &bytes(std::size_t value)
+    {
+        const unsigned base = value ? memstats_log2(value) / 10 : 0;
+        return integer(value >> (10 * base)) << prefix(base) << 'B';
+    }
+
+    MemStatsFormatter &signed_bytes(long long value)
+    {
+        if (value < 0)
+            buffer.push_back('-');
+        return bytes(std::size_t(value < 0 ? -value : value));
+    }
+
+    // 'value' in the largest unit of time below it, truncated
+    MemStatsFormatter &seconds(double value)
+    {
+        static const std::array<const char *, 4> units{"ns", "us", "ms", "s"};
+        value *= 1e9;
+        std::size_t unit = 0;
+        for (; value >= 1000. and unit + 1 != units.size(); ++unit)
+            value /= 1000.;
+        return integer(std::size_t(value)) << units[unit];
+    }
+
+    MemStatsFormatter &column()
+    {
+        start = buffer.size();
+        return *this;
+    }
+
+    // pads the column with spaces after its text up to 'width' characters
+    MemStatsFormatter &left(std::size_t width)
+    {
+        if (buffer.size() - start < width)
+            buffer.insert(buffer.end(), width - (buffer.size() - start), ' ');
+        return *this;
+    }
+
+    // pads the column with spaces before its text up to 'width' characters
+    MemStatsFormatter &right(std::size_t width)
+    {
+        if (buffer.size() - start < width)
+            buffer.insert(buffer.begin() + start, width - (buffer.size() - start), ' ');
+        return *this;
+    }
+
+    // text formatted so far, e.g. for a label
+    string str() const
+    {
+        return string(buffer.data(), buffer.size());
+    }
+
+    void write()
+    {
+        memstats_write_output(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+};
+
+#if MEMSTAT_PRELOAD
+/** Descriptor the reports are written to when preloaded.
+ * 'LD_PRELOAD' is inherited by child processes, which all report at exit, so reports never go to the standard output
+ * of the program, where they would corrupt what its callers read from it. With 'MEMSTATS_REPORT_FILE', each process
+ * writes to '<MEMSTATS_REPORT_FILE>.<pid>', opened on its first report (again in forked children) and never closed.
+ */
+int memstats_report_fd()
+{
+    static int fd = -1;
+    static pid_t owner = 0;
+    if (not memstats_report_path)
+        return memstats_stderr_fd;
+    if (owner != ::getpid())
+    {
+        owner = ::getpid();
+        MemStatsFormatter name;
+        name << memstats_report_path << '.';
+        name.integer(std::size_t(owner)) << '\0';
+        fd = ::open(name.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            std::cerr << "MemStats report file '" << name.str().c_str() << "' could not be opened\n";
+    }
+    return fd < 0 ? memstats_stderr_fd : fd;
+}
+#endif
+
+void memstats_write_output(const char *data, std::size_t size)
+{
+#if MEMSTAT_PRELOAD
+    const int fd = memstats_report_fd();
+    while (size)
+    {
+        const ssize_t written = ::write(fd, data, size);
+        if (written < 0 and errno == EINTR)
+            continue;
+        if (written < 0)
+            return;
+        data += written;
+        size -= std::size_t(written);
+    }
+#else
+    std::cout.write(data, std::streamsize(size));
+    std::cout.flush();
+#endif
+}
+
+template <class T>
+string memstats_to_string(const T &value)
+{
+    stringstream stream;
+    stream << value;
+    return stream.str();
+}
+
+#if MEMSTAT_HAVE_STACKTRACE
+/** Label of a stack frame, i.e. its symbol, file and line.
+ * Symbolization is expensive and the same frames appear on every report, so labels are resolved the first time a frame
+ * is printed or traced and cached for the rest of the program. Thread-safe, since traces are written outside of 'memstats_lock'.
+ */
+const string &memstats_frame_label(const std::stacktrace_entry &entry)
+{
+    using Labels = unordered_map<std::stacktrace_entry, string>;
+    // never destroyed, reports may still happen while static objects are destroyed
+    static Labels *const labels = ::new (MallocAllocator<Labels>{}.allocate(1)) Labels;
+    static MemStatsSpinLock lock;
+    // labels are never erased, so references to them stay valid after unlocking
+    std::lock_guard<MemStatsSpinLock> guard{lock};
+    auto it = labels->find(entry);
+    if (it == labels->end())
+    {
+        // unresolved frames are labelled with their address
+        MemStatsFormatter label;
+        const std::string description = entry.description();
+        if (description.empty())
+            label.hex(std::uint64_t(entry.native_handle()));
+        else
+            label << description;
+        const std::string file = entry.source_file();
+        if (not file.empty())
+            (label << " at " << file << ':').integer(entry.source_line());
+        it = labels->emplace(entry, label.str()).first;
+    }
+    return it->second;
+}
+#endif
+
+// label of a stacktrace of 'memstats_stacks', its id followed by its frames on their own lines. Must be called with 'memstats_lock' held.
+string memstats_stack_label(std::uint32_t stack)
+{
+    MemStatsFormatter label;
+    label << "stack ";
+    if (stack)
+        label.integer(stack);
+    else
+        label << "unknown";
+#if MEMSTAT_HAVE_STACKTRACE
+    if (stack)
+        for (const auto &entry : memstats_stacks[stack])
+            label << "\n        " << memstats_frame_label(entry);
+#endif
+    return label.str();
+}
+
+
+/** Binary trace of the recorded events.
+ * A trace is a 'MemStatsTraceHeader' followed by blocks, each one a 'MemStatsTraceBlock' and a payload padded to 8 bytes:
+ *  - events: 'MemStatsTraceEvents' followed by the 'MemStatsPackedInfo' records of a chunk, as stored in memory
+ *  - thread: 'std::uint32_t' index and padding, followed by the label of the thread
+ *  - frame:  'std::uint64_t' address, followed by the label of the frame (string table of the frames)
+ *  - stack:  'std::uint32_t' id and depth, followed by the 'std::uint64_t' addresses of its frames
+ *  - region: 'std::uint32_t' id and id of its parent, followed by its name
+ *  - report: 'std::uint32_t' number of cuts and padding, followed by the 'MemStatsTraceCut' of the threads taken by the
+ *            report and its name. Marks the end of the events seen by it, i.e. the ones written before it, except for
+ *            the chunks of a thread started after it was taken
+ *  - clock:  'double' seconds per tick of the event timestamps, calibrations get more accurate over time
+ * Threads are indexed from 1 in order of appearance. Threads, frames, stacks and regions are written once, before the
+ * first event referring to them. Addresses of the blocks are only recorded when tracking the live heap.
+ * Integers are stored in the byte order of the traced program, so traces are analyzed on the same architecture.
+ */
+struct MemStatsTraceHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t flags;
+    std::uint64_t sample_interval;
+    // seconds per tick of the event timestamps, superseded by the clock blocks
+    double tick_seconds;
+};
+
+static const char memstats_trace_magic[8] = {'M', 'E', 'M', 'S', 'T', 'A', 'T', 'S'};
+static const std::uint32_t memstats_trace_version = 4;
+// flag of traces of programs tracking the live heap
+static const std::uint32_t memstats_trace_live = 1;
+// flag of traces of programs measuring the time spent in 'malloc'/'free'
+static const std::uint32_t memstats_trace_latency = 2;
+static const std::uint32_t memstats_trace_lifetime = 4;
+
+enum class MemStatsTraceBlockType : std::uint32_t
+{
+    events = 1,
+    thread,
+    frame,
+    stack,
+    report,
+    clock,
+    region
+};
+
+struct MemStatsTraceBlock
+{
+    std::uint32_t type;
+    // size of the payload without padding
+    std::uint32_t size;
+};
+
+// start of the events of a chunk, see 'MemStatsChunk'
+struct MemStatsTraceEvents
+{
+    // index of the thread that recorded the events
+    std::uint32_t thread;
+    // region and time of the event preceding the first one
+    std::uint32_t region;
+    std::int64_t time;
+    // see 'MemStatsChunk::sequence'
+    std::uint64_t sequence;
+};
+
+// chunks of the thread of index 'thread' from 'sequence' on were started after a report took the thread
+struct MemStatsTraceCut
+{
+    std::uint32_t thread;
+    std::uint32_t padding;
+    std::uint64_t sequence;
+};
+
+inline std::size_t memstats_trace_padded(std::size_t size)
+{
+    return (size + 7) & ~std::size_t{7};
+}
+
+// Trace file being written, blocks are gathered in a buffer allocated once and written at once. Guarded by 'memstats_trace_mutex'.
+struct MemStatsTraceWriter
+{
+    static constexpr std::size_t capacity = std::size_t{1} << 20;
+
+    std::FILE *file = nullptr;
+    unsigned char *buffer = MallocAllocator<unsigned char>{}.allocate(capacity);
+    std::size_t size = 0;
+    unordered_map<std::thread::id, std::uint32_t> threads;
+#if MEMSTAT_HAVE_STACKTRACE
+    // whether each stack id has been written, and addresses of the frames already written
+    vector<bool> stacks;
+    unordered_set<std::uint64_t> frames;
+#endif
+    // whether each region id has been written
+    vector<bool> regions;
+
+    void append(const void *data, std::size_t bytes)
+    {
+        if (not bytes)
+            return;
+        if (size + bytes > capacity)
+            flush_buffer();
+        if (bytes > capacity)
+            std::fwrite(data, 1, bytes, file);
+        else
+        {
+            std::memcpy(buffer + size, data, bytes);
+            size += bytes;
+        }
+    }
+
+    void block(MemStatsTraceBlockType type, const void *data, std::size_t bytes, const void *tail = nullptr, std::size_t tail_bytes = 0)
+    {
+        static const unsigned char padding[8] = {};
+        const MemStatsTraceBlock header{std::uint32_t(type), std::uint32_t(bytes + tail_bytes)};
+        append(&header, sizeof header);
+        append(data, bytes);
+        append(tail, tail_bytes);
+        append(padding, memstats_trace_padded(header.size) - header.size);
+    }
+
+    std::uint32_t thread(std::thread::id id)
+    {
+        auto it = threads.find(id);
+        if (it != threads.end())
+            return it->second;
+        const std::uint32_t header[2] = {std::uint32_t(threads.size() + 1), 0};
+        threads.emplace(id, header[0]);
+        const string label = memstats_to_string(id);
+        block(MemStatsTraceBlockType::thread, header, sizeof header, label.data(), label.size());
+        return header[0];
+    }
+
+    // marks 'id' as written, returns whether it was not written yet
+    static bool first(vector<bool> &written, std::uint32_t id)
+    {
+        if (id >= written.size())
+            written.resize(id + 1);
+        if (written[id])
+            return false;
+        written[id] = true;
+        return true;
+    }
+
+    // writes the stack 'id' of 'memstats_stacks' if not written yet
+    void stack(std::uint32_t id)
+    {
+#if MEMSTAT_HAVE_STACKTRACE
+        if (not id or not first(stacks, id))
+            return;
+        vector<std::uint64_t> addresses;
+        for (const auto &entry : memstats_stacks[id])
+        {
+            const std::uint64_t address = entry.native_handle();
+            if (frames.insert(address).second)
+            {
+                const string &label = memstats_frame_label(entry);
+                block(MemStatsTraceBlockType::frame, &address, sizeof address, label.data(), label.size());
+            }
+            addresses.push_back(address);
+        }
+        const std::uint32_t header[2] = {id, std::uint32_t(addresses.size())};
+        block(MemStatsTraceBlockType::stack, header, sizeof header, addresses.data(), addresses.size() * sizeof(std::uint64_t));
+#else
+        static_cast<void>(id);
+#endif
+    }
+
+    // writes the region 'id' of 'memstats_regions', after the regions enclosing it, if not written yet
+    void region(std::uint32_t id)
+    {
+        if (not id or (id < regions.size() and regions[id]))
+            return;
+        const MemStatsRegionNode node = memstats_regions.node(id);
+        region(node.parent);
+        first(regions, id);
+        const std::uint32_t header[2] = {id, node.parent};
+        block(MemStatsTraceBlockType::region, header, sizeof header, node.name.data(), node.name.size());
+    }
+
+    // writes the events of a chunk recorded by the thread of index 'thread', after the stacks and regions they refer to
+    void events(std::uint32_t thread, const MemStatsChunk &chunk)
+    {
+        region(chunk.region);
+        for (std::size_t i = 0; i != chunk.size; ++i)
+        {
+            const MemStatsPackedInfo &packed = chunk.events[i];
+            switch (packed.kind)
+            {
+            case MemStatsPackedInfo::allocation:
+            case MemStatsPackedInfo::deallocation:
+            case MemStatsPackedInfo::extension_lifetime:
+                stack(packed.stack);
+                break;
+            case MemStatsPackedInfo::extension_region:
+                region(std::uint32_t(packed.value()));
+                break;
+            }
+        }
+        const MemStatsTraceEvents header{thread, chunk.region, chunk.time, chunk.sequence};
+        block(MemStatsTraceBlockType::events, &header, sizeof header, chunk.events, chunk.size * sizeof(MemStatsPackedInfo));
+    }
+
+    void flush_buffer()
+    {
+        std::fwrite(buffer, 1, size, file);
+        size = 0;
+    }
+
+    void flush()
+    {
+        flush_buffer();
+        std::fflush(file);
+    }
+};
+
+// Opened on the first write and never closed nor destroyed, so that late events can still be written
+MEMSTATS_CONSTINIT static MemStatsTraceWriter *memstats_trace_writer = nullptr;
+MEMSTATS_CONSTINIT static bool memstats_trace_failed = false;
+
+// Must be called with 'memstats_trace_mutex' held
+MemStatsTraceWriter *memstats_trace_open()
+{
+    if (memstats_trace_writer or memstats_trace_failed)
+        return memstats_trace_writer;
+    std::FILE *file = std::fopen(memstats_trace_path, "wb");
+    if (not file)
+    {
+        std::cerr << "MemStats trace file '" << memstats_trace_path << "' could not be opened\n";
+        memstats_trace_failed = true;
+        return nullptr;
+    }
+    memstats_trace_writer = MallocAllocator<MemStatsTraceWriter>{}.allocate(1);
+    ::new (memstats_trace_writer) MemStatsTraceWriter;
+    memstats_trace_writer->file = file;
+
+    MemStatsTraceHeader header{};
+    std::memcpy(header.magic, memstats_trace_magic, sizeof header.magic);
+    header.version = memstats_trace_version;
+    header.flags = (memstats_track_live ? memstats_trace_live : 0) | (memstats_latency ? memstats_trace_latency : 0)
+                 | (memstats_lifetime ? memstats_trace_lifetime : 0);
+    header.sample_interval = memstats_sample_interval;
+    header.tick_seconds = memstats_tick_seconds();
+    memstats_trace_writer->append(&header, sizeof header);
+    return memstats_trace_writer;
+}
+
+// appends the events of a list of chunks recorded by 'thread' to the trace file, events are kept in the chunks
+void memstats_trace_write(std::thread::id thread, MemStatsChunk *chunks)
+{
+    if (not memstats_trace_path or not chunks or not chunks->size)
+        return;
+    std::lock_guard<std::mutex> lock{memstats_trace_mutex};
+    const MemStatsBusyGuard busy;
+    MemStatsTraceWriter *writer = memstats_trace_open();
+    if (not writer)
+        return;
+    const std::uint32_t index = writer->thread(thread);
+    for (MemStatsChunk *chunk = chunks; chunk and chunk->size; chunk = chunk->next)
+        writer->events(index, *chunk);
+    const double tick_seconds = memstats_tick_seconds();
+    writer->block(MemStatsTraceBlockType::clock, &tick_seconds, sizeof tick_seconds);
+    writer->flush();
+}
+
+// chunks taken from a thread by a report, see 'MemStatsThread::take'
+struct MemStatsTaken
+{
+    MemStatsThread *thread;
+    MemStatsChunk *chunks;
+    // state of the thread before it was taken, a retired thread does not record anymore so nothing is left behind
+    unsigned char state;
+    // sequence number of the chunks the thread started after it was taken, when tracing
+    std::uint64_t cut;
+};
+
+// marks the end of the events of a report, whose threads were taken in 'taken'
+void memstats_trace_report(const char *report_name, const vector<MemStatsTaken> &taken)
+{
+    if (not memstats_trace_path)
+        return;
+    std::lock_guard<std::mutex> lock{memstats_trace_mutex};
+    const MemStatsBusyGuard busy;
+    if (MemStatsTraceWriter *writer = memstats_trace_open())
+    {
+        vector<MemStatsTraceCut> cuts;
+        for (const MemStatsTaken &item : taken)
+            if (item.state == MemStatsThread::active or item.state == MemStatsThread::retired)
+                cuts.push_back(MemStatsTraceCut{writer->thread(item.thread->thread), 0, item.cut});
+        const std::uint32_t header[2] = {std::uint32_t(cuts.size()), 0};
+        vector<unsigned char> payload(sizeof header + cuts.size() * sizeof(MemStatsTraceCut));
+        std::memcpy(payload.data(), header, sizeof header);
+        if (not cuts.empty())
+            std::memcpy(payload.data() + sizeof header, cuts.data(), cuts.size() * sizeof(MemStatsTraceCut));
+        writer->block(MemStatsTraceBlockType::report, payload.data(), payload.size(), report_name, std::strlen(report_name));
+        writer->flush();
+    }
+}
+
+void MemStatsThread::grow()
+{
+    // with a drain thread, the full chunk is handed over to it and events continue on a spare chunk
+    if (head and memstats_drain_interval and full_size.load(std::memory_order_relaxed) < max_full)
+    {
+        if (detach())
+            give_full(head);
+        publish(spare_chunk());
+        return;
+    }
+    // Unless the drain thread lags behind, then the chunks handed over are taken back and folded here, oldest first.
+    // Chunks are folded into the statistics loaded before detaching them, so that they go to the report that takes
+    // 'current' afterwards, as their events precede the cut written by that report to the trace file.
+    if (head and memstats_drain_interval)
+    {
+        MemStatsAggregate &own = aggregate();
+        MemStatsChunk *chunks = take_full();
+        if (not detach())
+        {
+            // a report took 'current' meanwhile, it drains the chunks handed over once this event is written
+            while (chunks)
+            {
+                MemStatsChunk *chunk = chunks;
+                chunks = chunk->next;
+                give_full(chunk);
+            }
+            publish(spare_chunk());
+            return;
+        }
+        MemStatsChunk **last = &chunks;
+        while (*last)
+            last = &(*last)->next;
+        *last = head;
+        memstats_trace_write(thread, chunks);
+        while (chunks)
+        {
+            MemStatsChunk *chunk = chunks;
+            chunks = chunk->next;
+            chunk->for_each([&](const MemStatsInfo &info) { own.add(info); });
+            chunk->size = 0;
+            chunk->next = spares;
+            spares = chunk;
+        }
+        publish(spare_chunk());
+        return;
+    }
+    // with a trace file, stored events are written out and folded instead of growing the buffer
+    if (head and memstats_trace_path)
+    {
+        MemStatsAggregate &own = aggregate();
+        if (detach())
+        {
+            memstats_trace_write(thread, head);
+            for (MemStatsChunk *chunk = head; chunk;)
+            {
+                MemStatsChunk *next = chunk->next;
+                chunk->for_each([&](const MemStatsInfo &info) { own.add(info); });
+                chunk->size = 0;
+                chunk->next = spares;
+                spares = chunk;
+                chunk = next;
+            }
+        }
+        publish(spare_chunk());
+        return;
+    }
+    // chunks appended to a list taken meanwhile are read by the report once this event is written
+    MemStatsChunk *chunk = spare_chunk();
+    if (tail)
+        tail = tail->next = chunk;
+    else
+        publish(chunk);
+}
+
+void MemStatsThread::give_spare(MemStatsChunk *chunks)
+{
+    if (not chunks)
+        return;
+    MemStatsChunk *last = chunks;
+    for (;; last = last->next)
+    {
+        last->size = 0;
+        if (not last->next)
+            break;
+    }
+    last->next = spare.load(std::memory_order_relaxed);
+    while (not spare.compare_exchange_weak(last->next, chunks, std::memory_order_release, std::memory_order_relaxed))
+        ;
+}
+
+MemStatsChunk *MemStatsThread::spare_chunk()
+{
+    if (not spares)
+        spares = spare.exchange(nullptr, std::memory_order_acquire);
+    MemStatsChunk *chunk = spares;
+    if (chunk)
+        spares = chunk->next;
+    else
+    {
+        chunk = MallocAllocator<MemStatsChunk>{}.allocate(1);
+        ::new (chunk) MemStatsChunk;
+    }
+    chunk->next = nullptr;
+    chunk->time = time;
+    chunk->region = region;
+    if (memstats_trace_path)
+        chunk->sequence = memstats_chunk_sequence.fetch_add(1, std::memory_order_relaxed);
+    return chunk;
+}
+
+MemStatsChunk *MemStatsThread::take_full()
+{
+    MemStatsChunk *chunks = nullptr;
+    std::size_t size = 0;
+    for (MemStatsChunk *chunk = full.exchange(nullptr, std::memory_order_acquire); chunk; ++size)
+    {
+        MemStatsChunk *next = chunk->next;
+        chunk->next = chunks;
+        chunks = chunk;
+        chunk = next;
+    }
+    full_size.fetch_sub(size, std::memory_order_relaxed);
+    return chunks;
+}
+
+void MemStatsThread::give_full(MemStatsChunk *chunk)
+{
+    // counted before being pushed, so that takers never subtract more than what was counted
+    full_size.fetch_add(1, std::memory_order_relaxed);
+    chunk->next = full.load(std::memory_order_relaxed);
+    while (not full.compare_exchange_weak(chunk->next, chunk, std::memory_order_release, std::memory_order_relaxed))
+        ;
+}
+
+MemStatsAggregate &MemStatsThread::aggregate()
+{
+    // reloaded on every event, a report may have taken it since the last one
+    MemStatsAggregate *aggregate = aggregated.load(std::memory_order_seq_cst);
+    if (not aggregate)
+    {
+        aggregate = ::new (MallocAllocator<MemStatsAggregate>{}.allocate(1)) MemStatsAggregate;
+        aggregate->random_state = memstats_random(random_state) | 1;
+        aggregated.store(aggregate, std::memory_order_release);
+    }
+    return *aggregate;
+}
+
+MemStatsChunk *MemStatsThread::take()
+{
+    MemStatsChunk *chunks = current.exchange(nullptr, std::memory_order_seq_cst);
+    taken_aggregate = aggregated.exchange(nullptr, std::memory_order_seq_cst);
+    return chunks;
+}
+
+void MemStatsThread::settle()
+{
+    while (writing.load(std::memory_order_seq_cst))
+        std::this_thread::yield();
+    if (taken_aggregate)
+    {
+        folded.merge(*taken_aggregate);
+        taken_aggregate->~MemStatsAggregate();
+        MallocAllocator<MemStatsAggregate>{}.deallocate(taken_aggregate, 1);
+        taken_aggregate = nullptr;
+    }
+}
+
+void MemStatsThread::push(const MemStatsInfo &info)
+{
+    MemStatsPackedInfo packed[8];
+    std::size_t count = 0;
+    const std::int64_t delta = info.time - time;
+    if (info.size > std::numeric_limits<std::uint32_t>::max())
+        packed[count++] = MemStatsPackedInfo::extension(MemStatsPackedInfo::extension_size, info.size);
+    if (delta < 0 or delta > std::numeric_limits<std::uint32_t>::max())
+        packed[count++] = MemStatsPackedInfo::extension(MemStatsPackedInfo::extension_delta, std::uint64_t(delta));
+    if (memstats_trace_path and memstats_track_live)
+        packed[count++] = MemStatsPackedInfo::extension(MemStatsPackedInfo::extension_ptr, reinterpret_cast<std::uintptr_t>(info.ptr));
+    if (info.timed)
+        packed[count++] = MemStatsPackedInfo::extension(MemStatsPackedInfo::extension_latency, info.latency);
+    if (info.lifetime_weight)
+    {
+        packed[count] = MemStatsPackedInfo::extension(MemStatsPackedInfo::extension_lifetime, info.lifetime);
+        packed[count++].stack = info.origin;
+        if (info.lifetime_weight != 1)
+            packed[count++] = MemStatsPackedInfo::extension(MemStatsPackedInfo::extension_weight, info.lifetime_weight);
+    }
+    if (info.region != region)
+        packed[count++] = MemStatsPackedInfo::extension(MemStatsPackedInfo::extension_region, info.region);
+    MemStatsPackedInfo &event = packed[count++];
+    event.size = std::uint32_t(info.size);
+    event.delta = std::uint32_t(delta);
+    event.stack = info.stack;
+    event.size_class = std::uint16_t(info.size_class);
+    event.kind = info.operation == MemStatsOperation::allocation ? MemStatsPackedInfo::allocation : MemStatsPackedInfo::deallocation;
+    event.alignment = std::uint8_t(info.alignment ? memstats_log2(info.alignment) + 1 : 0);
+
+    // an event and its extensions are kept within the same chunk
+    if (not tail or tail->size + count > MemStatsChunk::capacity)
+        grow();
+    std::copy(packed, packed + count, tail->events + tail->size);
+    tail->size += count;
+    time = info.time;
+    region = info.region;
+}
+
+/** Folds the chunks handed over by a thread into its drained statistics, they are given back as spare chunks.
+ * Chunks from the sequence number 'cut' on are handed over again, a report leaves them to the next one.
+ * Only takes 'memstats_drained_lock', so that the drain thread folds and writes out events outside of 'memstats_lock'.
+ */
+void memstats_drain(MemStatsThread &thread_events, std::uint64_t cut = std::numeric_limits<std::uint64_t>::max())
+{
+    auto lock = std::unique_lock<std::recursive_mutex>{memstats_drained_lock};
+    const MemStatsBusyGuard busy;
+    MemStatsChunk *chunks = thread_events.take_full();
+    MemStatsChunk **last = &chunks;
+    while (*last and (*last)->sequence < cut)
+        last = &(*last)->next;
+    for (MemStatsChunk *chunk = *last; chunk;)
+    {
+        MemStatsChunk *next = chunk->next;
+        thread_events.give_full(chunk);
+        chunk = next;
+    }
+    *last = nullptr;
+    memstats_trace_write(thread_events.thread, chunks);
+    while (chunks)
+    {
+        MemStatsChunk *chunk = chunks;
+        chunks = chunk->next;
+        chunk->for_each([&](const MemStatsInfo &info) { thread_events.drained.add(info); });
+        chunk->size = 0;
+        chunk->next = thread_events.spare.load(std::memory_order_relaxed);
+        while (not thread_events.spare.compare_exchange_weak(chunk->next, chunk, std::memory_order_release, std::memory_order_relaxed))
+            ;
+    }
+}
+
+void memstats_drain_all()
+{
+    auto lock = std::unique_lock<std::recursive_mutex>{memstats_drained_lock};
+    for (MemStatsThread *thread_events = memstats_threads.load(std::memory_order_acquire); thread_events; thread_events = thread_events->next)
+        memstats_drain(*thread_events);
+}
+
+// Background drain thread, woken up every 'memstats_drain_interval' milliseconds until the program exits
+static std::mutex memstats_drain_mutex;
+static std::condition_variable memstats_drain_condition;
+static bool memstats_drain_stop = false;
+static std::thread memstats_drain_thread;
+
+bool init_memstats_drain()
+{
+    if (not memstats_drain_interval)
+        return false;
+    // the drain thread is not instrumented, nor its creation
+    const MemStatsBusyGuard busy;
+    memstats_drain_thread = std::thread([]
+    {
+        memstats_thread_busy = true;
+        std::unique_lock<std::mutex> lock{memstats_drain_mutex};
+        while (not memstats_drain_stop)
+        {
+            memstats_drain_condition.wait_for(lock, std::chrono::milliseconds(memstats_drain_interval));
+            memstats_drain_all();
+        }
+    });
+    // registered after the report at exit, so the thread is stopped before it
+    std::atexit([]
+    {
+        {
+            std::lock_guard<std::mutex> lock{memstats_drain_mutex};
+            memstats_drain_stop = true;
+        }
+        memstats_drain_condition.notify_one();
+        memstats_drain_thread.join();
+    });
+    return true;
+}
+
+static const bool memstats_drain_guard = init_memstats_drain();
+
+// Number of allocations, allocated bytes and net live bytes (allocated minus freed bytes) over time
+struct MemStatsTimeline
+{
+    std::int64_t begin = std::numeric_limits<std::int64_t>::max(), end = std::numeric_limits<std::int64_t>::min();
+    double tick_seconds = 0.;
+    vector<std::size_t> count, bytes;
+    vector<long long> net;
+    // whether every deallocation was recorded with its size, otherwise the net live bytes are not drawn
+    bool net_known = true;
+
+    // splits the spans between the first and the last event of 'series' into 'bins' buckets, by the start of each span
+    void assign(const MemStatsSeries &series, std::size_t bins)
+    {
+        std::size_t first = series.count.size(), last = 0;
+        for (std::size_t i = 0; i != series.count.size(); ++i)
+            if (series.count[i] or series.net[i])
+            {
+                first = std::min(first, i);
+                last = i;
+            }
+        if (first == series.count.size())
+            return;
+        begin = series.origin + std::int64_t(std::uint64_t(first) << series.shift);
+        end = series.origin + std::int64_t(std::uint64_t(last + 1) << series.shift) - 1;
+        count.resize(bins);
+        bytes.resize(bins);
+        net.resize(bins);
+        for (std::size_t i = first; i <= last; ++i)
+        {
+            const std::int64_t time = series.origin + std::int64_t(std::uint64_t(i) << series.shift);
+            const std::size_t bin = std::size_t((bins * std::uint64_t(time - begin)) / (std::uint64_t(end - begin) + 1));
+            count[bin] += series.count[i];
+            bytes[bin] += series.bytes[i];
+            net[bin] += series.net[i];
+        }
+    }
+
+    // first pass over the events: span of the timeline
+    void extend(std::int64_t time)
+    {
+        begin = std::min(begin, time);
+        end = std::max(end, time);
+    }
+
+    // second pass over the events: 'n' is the number of allocations represented by an allocation event
+    void add(std::size_t bins, std::int64_t time, MemStatsOperation operation, std::size_t size, std::size_t n)
+    {
+        if (count.empty())
+        {
+            count.resize(bins);
+            bytes.resize(bins);
+            net.resize(bins);
+        }
+        const std::size_t bin = std::size_t((bins * std::uint64_t(time - begin)) / (std::uint64_t(end - begin) + 1));
+        if (operation == MemStatsOperation::deallocation)
+            net[bin] -= size;
+        else if (size)
+        {
+            count[bin] += n;
+            bytes[bin] += n * size;
+            net[bin] += n * size;
+        }
+    }
+};
+
+// labelled statistics of one line of a report, 'peak' is only shown on the live threads and total
+struct MemStatsRow
+{
+    string label;
+    Stats stats;
+    std::size_t peak;
+};
+
+// labelled latencies of one line of a report
+struct MemStatsLatencyRow
+{
+    string label;
+    MemStatsLatency latency;
+};
+
+// labelled lifetimes of one line of a report
+struct MemStatsLifetimeRow
+{
+    string label;
+    DurationStats lifetime;
+};
+
+// contents of a report, gathered either from the running program or from a trace
+struct MemStatsReport
+{
+    Stats total;
+    vector<MemStatsRow> threads, frames;
+    // regions including the ones nested in them, labelled by their path
+    vector<MemStatsRow> regions;
+    // allocations within no-alloc scopes by scope and stacktrace, and the ones that were overwritten before being logged
+    vector<MemStatsRow> noalloc;
+    std::size_t noalloc_unlogged = 0;
+    bool live = false;
+    MemStatsRow live_total;
+    vector<MemStatsRow> live_threads, live_frames;
+    bool latency = false;
+    MemStatsLatency latency_total;
+    vector<MemStatsLatencyRow> latency_threads, latency_frames;
+    bool lifetime = false;
+    DurationStats lifetime_total;
+    // frames of the allocation of the freed blocks
+    vector<MemStatsLifetimeRow> lifetime_frames;
+    MemStatsTimeline timeline;
+};
+
+/** Appends to 'rows' the entries of 'stats' (frames, stacks or threads) with the most bytes (or allocations), at most 'MEMSTATS_TOP_N'
+ * of them in descending order. Only the selected entries are labelled, so the rest of the frames are never symbolized.
+ */
+template <class Map, class Label>
+void memstats_rank_rows(const Map &stats, vector<MemStatsRow> &rows, Label label)
+{
+    using Entry = typename Map::value_type;
+    vector<const Entry *> entries;
+    entries.reserve(stats.size());
+    for (const Entry &entry : stats)
+        if (entry.second.count)
+            entries.push_back(&entry);
+    const bool by_count = memstats_rank_by_count();
+    auto greater = [by_count](const Entry *a, const Entry *b)
+    {
+        if (by_count)
+            return std::tie(a->second.count, a->second.size) > std::tie(b->second.count, b->second.size);
+        return std::tie(a->second.size, a->second.count) > std::tie(b->second.size, b->second.count);
+    };
+    std::size_t n = memstats_top_n();
+    if (n == 0 or n > entries.size())
+        n = entries.size();
+    std::partial_sort(entries.begin(), entries.begin() + n, entries.end(), greater);
+    for (std::size_t i = 0; i != n; ++i)
+        rows.push_back(MemStatsRow{label(entries[i]->first), entries[i]->second, 0});
+}
+
+/** Appends to 'rows' the regions with allocations, each one with the statistics of its own allocations ('region_stats')
+ * rolled up with the ones of the regions nested in it. Rows are listed depth-first: nested regions follow their parent,
+ * siblings by decreasing bytes. 'nodes' is the tree of regions, where parents have lower ids than their children.
+ */
+void memstats_region_rows(const unordered_map<std::uint32_t, Stats> &region_stats, const vector<MemStatsRegionNode> &nodes, vector<MemStatsRow> &rows)
+{
+    vector<Stats> rolled(nodes.size());
+    for (const auto &pair : region_stats)
+        for (std::uint32_t id = pair.first; id and id < nodes.size(); id = nodes[id].parent)
+            rolled[id].merge(pair.second);
+    vector<vector<std::uint32_t>> children(nodes.size());
+    for (std::uint32_t id = 1; id < nodes.size(); ++id)
+        if (rolled[id].count)
+            children[nodes[id].parent].push_back(id);
+    vector<string> paths(nodes.size());
+    vector<std::uint32_t> pending(1, 0);
+    while (not pending.empty())
+    {
+        const std::uint32_t id = pending.back();
+        pending.pop_back();
+        if (id)
+            rows.push_back(MemStatsRow{paths[id], rolled[id], 0});
+        // pushed in increasing bytes, so that the largest one is visited first
+        vector<std::uint32_t> &nested = children[id];
+        std::sort(nested.begin(), nested.end(), [&](std::uint32_t a, std::uint32_t b) { return rolled[a].size < rolled[b].size; });
+        for (std::uint32_t child : nested)
+        {
+            paths[child] = id ? paths[id] + "/" + nodes[child].name : nodes[child].name;
+            pending.push_back(child);
+        }
+    }
+}
+
+/** Appends to 'rows' the entries of 'frame_latency' with the slowest calls, ranked by the 99th percentile of their
+ * latency, at most 'MEMSTATS_TOP_N' of them. Slow call sites are seldom the most frequent ones, so they are ranked on their own.
+ */
+template <class Map, class Label>
+void memstats_rank_latency_frames(const Map &frame_latency, vector<MemStatsLatencyRow> &rows, Label label)
+{
+    using Entry = typename Map::value_type;
+    vector<std::pair<std::size_t, const Entry *>> entries;
+    entries.reserve(frame_latency.size());
+    for (const Entry &entry : frame_latency)
+        if (entry.second.allocation.count or entry.second.deallocation.count)
+            entries.push_back(std::make_pair(std::max(entry.second.allocation.quantile(0.99), entry.second.deallocation.quantile(0.99)), &entry));
+    auto greater = [](const std::pair<std::size_t, const Entry *> &a, const std::pair<std::size_t, const Entry *> &b)
+    {
+        return a.first > b.first;
+    };
+    std::size_t n = memstats_top_n();
+    if (n == 0 or n > entries.size())
+        n = entries.size();
+    std::partial_sort(entries.begin(), entries.begin() + n, entries.end(), greater);
+    for (std::size_t i = 0; i != n; ++i)
+        rows.push_back(MemStatsLatencyRow{label(entries[i].second->first), entries[i].second->second});
+}
+
+/** Appends to 'rows' the entries of 'frame_lifetime' with the most blocks freed within 'limit' ticks (then with the most
+ * freed blocks), at most 'MEMSTATS_TOP_N' of them. Short-lived allocations come first, they are the ones worth removing.
+ */
+template <class Map, class Label>
+void memstats_rank_lifetime_frames(const Map &frame_lifetime, vector<MemStatsLifetimeRow> &rows, std::size_t limit, Label label)
+{
+    using Entry = typename Map::value_type;
+    using Key = std::pair<std::size_t, std::size_t>;
+    vector<std::pair<Key, const Entry *>> entries;
+    entries.reserve(frame_lifetime.size());
+    for (const Entry &entry : frame_lifetime)
+        if (entry.second.count)
+            entries.push_back(std::make_pair(Key{entry.second.below(limit), entry.second.count}, &entry));
+    auto greater = [](const std::pair<Key, const Entry *> &a, const std::pair<Key, const Entry *> &b)
+    {
+        return a.first > b.first;
+    };
+    std::size_t n = memstats_top_n();
+    if (n == 0 or n > entries.size())
+        n = entries.size();
+    std::partial_sort(entries.begin(), entries.begin() + n, entries.end(), greater);
+    for (std::size_t i = 0; i != n; ++i)
+        rows.push_back(MemStatsLifetimeRow{label(entries[i].second->first), entries[i].second->second});
+}
+
+void print_legend()
+{
+    MemStatsFormatter legend;
+    legend << "\nMemStats Legend:\n\n";
+    legend << "  [{hist}]{max} | {accum}({count}) | {pos}\n\n";
+    legend << "• hist:   Distribution of number of 'new' allocations for a given number of bytes\n";
+    legend << "• max:    Maximum allocation requested to 'new'\n";
+    legend << "• accum:  Accumulated number of bytes requested\n";
+    legend << "• count:  Number of total allocation requests\n";
+    legend << "• pos:    Position of the measurment\n";
+    legend << "\nMemStats Histogram Legend:\n\n";
+    const auto str_precentage = memstats_str_hist_representation();
+    double per_width = 100. / str_precentage.second;
+    for (std::size_t i = 0; i != str_precentage.second; ++i)
+    {
+        legend << "• \'" << str_precentage.first[i] << "\' -> [";
+        legend.column().fixed(i * per_width, 1).right(4) << "%, ";
+        legend.column().fixed((i + 1) * per_width, 1).right(5) << '%' << (i + 1 == str_precentage.second ? ']' : ')') << '\n';
+    }
+    legend.write();
+}
+
+void memstats_print_report(const char *report_name, const MemStatsReport &report)
+{
+    if (report.total.count == 0 and report.noalloc.empty() and not report.noalloc_unlogged)
+        return;
+    const auto bins = memstats_bins();
+    MemStatsFormatter out{std::size_t{1} << 16};
+    out << "\n------------------- MemStats " << report_name << " -------------------\n";
+
+    const auto str_precentage = memstats_str_hist_representation();
+    auto format_bins = [&](const vector<std::size_t> &hist) -> MemStatsFormatter &
+    {
+        std::size_t max_size = 0;
+        for (auto size : hist)
+            max_size = std::max(size, max_size);
+        out << '[';
+        for (auto size : hist) {
+          const std::size_t bin_entry =
+            max_size ? (size * str_precentage.second) / max_size : 0;
+          // maximum value (size==max_size) will be out of range so we need to guard agains that
+          out << str_precentage.first[std::min(bin_entry, str_precentage.second - 1)];
+        }
+        return out << ']';
+    };
+
+    // bins of the histogram being formatted, reused by all rows
+    vector<std::size_t> hist(bins);
+    auto format_histogram = [&](const Stats &stats) -> MemStatsFormatter &
+    {
+        std::fill(hist.begin(), hist.end(), 0);
+        const std::size_t last_bucket = SizeHistogram::bucket(stats.max_size);
+        for (std::size_t bucket = 1; bucket <= last_bucket; ++bucket)
+        {
+            std::size_t count = stats.size_freq.count[bucket];
+            if (not count)
+                continue;
+            // spread the bucket over the bins it overlaps proportionally to the overlap, small sizes are exact and fall into one bin
+            std::size_t lower = SizeHistogram::lower_bound(bucket);
+            std::size_t upper = std::min(SizeHistogram::upper_bound(bucket), stats.max_size);
+            assert(lower <= upper);
+            std::size_t first_bin = (bins * (lower - 1)) / (stats.max_size);
+            std::size_t last_bin = (bins * (upper - 1)) / (stats.max_size);
+            std::size_t assigned = 0;
+            for (std::size_t bin = first_bin; bin <= last_bin; ++bin)
+            {
+                // largest size that falls into 'bin'
+                std::size_t bin_upper = std::min(upper, ((bin + 1) * stats.max_size + bins - 1) / bins);
+                std::size_t share = bin == last_bin ? count : std::size_t(double(count) * (bin_upper - lower + 1) / (upper - lower + 1));
+                hist[bin] += share - assigned;
+                assigned = share;
+            }
+        }
+        return format_bins(hist).column().bytes(stats.max_size).left(6);
+    };
+
+    auto print_stats = [&](const Stats &stats) -> MemStatsFormatter &
+    {
+        format_histogram(stats) << " | ";
+        out.column().bytes(stats.size).right(6) << '(';
+        return out.column().count(stats.count).left(5) << ") | ";
+    };
+
+    print_stats(report.total) << "Total\n";
+
+    for (const MemStatsRow &row : report.threads)
+      if (row.stats.size)
+        print_stats(row.stats) << "Thread " << row.label << '\n';
+
+    for (const MemStatsRow &row : report.frames)
+      if (row.stats.size)
+        print_stats(row.stats) << row.label << '\n';
+
+    for (const MemStatsRow &row : report.regions)
+        print_stats(row.stats) << "Region " << row.label << '\n';
+
+    for (const MemStatsRow &row : report.noalloc)
+        print_stats(row.stats) << "No-alloc " << row.label << '\n';
+    if (report.noalloc_unlogged)
+        out.integer(report.noalloc_unlogged) << " more allocations within no-alloc scopes were not logged\n";
+
+    if (report.live)
+    {
+        if (report.live_total.stats.count)
+            print_stats(report.live_total.stats) << "Live Total, peak ";
+        else
+            out << "No live allocations, peak ";
+        out.bytes(report.live_total.peak) << '\n';
+        for (const MemStatsRow &row : report.live_threads)
+        {
+            print_stats(row.stats) << "Live Thread " << row.label << ", peak ";
+            out.bytes(row.peak) << '\n';
+        }
+        for (const MemStatsRow &row : report.live_frames)
+            print_stats(row.stats) << "Live " << row.label << '\n';
+    }
+
+    if (report.latency and report.timeline.tick_seconds > 0.)
+    {
+        const double tick_seconds = report.timeline.tick_seconds;
+        auto print_latency = [&](const DurationStats &latency) -> MemStatsFormatter &
+        {
+            out << "p50 ";
+            out.column().seconds(latency.quantile(0.5) * tick_seconds).left(6) << " p99 ";
+            out.column().seconds(latency.quantile(0.99) * tick_seconds).left(6) << " p999 ";
+            out.column().seconds(latency.quantile(0.999) * tick_seconds).left(6) << " | ";
+            out.column().seconds(latency.max * tick_seconds).right(6) << '(';
+            return out.column().count(latency.count).left(5) << ") | ";
+        };
+        auto print_latency_row = [&](const MemStatsLatency &latency, const char *prefix, const string &label)
+        {
+            if (latency.allocation.count)
+                print_latency(latency.allocation) << "Latency new " << prefix << label << '\n';
+            if (latency.deallocation.count)
+                print_latency(latency.deallocation) << "Latency delete " << prefix << label << '\n';
+        };
+        print_latency_row(report.latency_total, "", "Total");
+        for (const MemStatsLatencyRow &row : report.latency_threads)
+            print_latency_row(row.latency, "Thread ", row.label);
+        for (const MemStatsLatencyRow &row : report.latency_frames)
+            print_latency_row(row.latency, "", row.label);
+    }
+
+    if (report.lifetime and report.lifetime_total.count and report.timeline.tick_seconds > 0.)
+    {
+        const double tick_seconds = report.timeline.tick_seconds;
+        const double threshold = memstats_lifetime_threshold();
+        const std::size_t limit = std::size_t(threshold / tick_seconds);
+        // lifetimes per decade, from below 10ns to 1s or more
+        vector<std::size_t> decades(10);
+        auto print_lifetime = [&](const DurationStats &lifetime) -> MemStatsFormatter &
+        {
+            std::fill(decades.begin(), decades.end(), 0);
+            for (std::size_t bucket = 0; bucket != SizeHistogram::bucket_count; ++bucket)
+                if (lifetime.ticks.count[bucket])
+                {
+                    const double nanoseconds = double(SizeHistogram::lower_bound(bucket)) * tick_seconds * 1e9;
+                    const int decade = nanoseconds < 1. ? 0 : int(std::log10(nanoseconds));
+                    decades[std::min(std::max(decade, 0), 9)] += lifetime.ticks.count[bucket];
+                }
+            format_bins(decades) << " p50 ";
+            out.column().seconds(lifetime.quantile(0.5) * tick_seconds).left(6) << " p99 ";
+            out.column().seconds(lifetime.quantile(0.99) * tick_seconds).left(6) << " | ";
+            out.column().seconds(lifetime.max * tick_seconds).right(6) << '(';
+            out.column().count(lifetime.count).left(5) << ") | ";
+            out.column().count(lifetime.below(limit)).left(5) << " <= ";
+            return out.column().seconds(threshold).left(6) << " | ";
+        };
+        print_lifetime(report.lifetime_total) << "Lifetime Total\n";
+        for (const MemStatsLifetimeRow &row : report.lifetime_frames)
+            print_lifetime(row.lifetime) << "Lifetime " << row.label << '\n';
+    }
+
+    const MemStatsTimeline &timeline = report.timeline;
+    if (not timeline.count.empty())
+    {
+        const double bin_seconds = double(timeline.end - timeline.begin) * timeline.tick_seconds / timeline.count.size();
+        auto rate = [&](std::size_t value)
+        {
+            return bin_seconds > 0. ? std::size_t(value / bin_seconds) : value;
+        };
+        std::size_t max_count = 0, max_bytes = 0, total_count = 0, total_bytes = 0;
+        for (std::size_t bin = 0; bin != timeline.count.size(); ++bin)
+        {
+            max_count = std::max(max_count, timeline.count[bin]);
+            max_bytes = std::max(max_bytes, timeline.bytes[bin]);
+            total_count += timeline.count[bin];
+            total_bytes += timeline.bytes[bin];
+        }
+        // net live bytes at the end of each bucket, shifted by its minimum so that it can be drawn
+        vector<long long> timeline_net(timeline.net.size());
+        vector<std::size_t> timeline_live(timeline.net.size());
+        long long net = 0, min_net = 0, max_net = 0;
+        for (std::size_t bin = 0; bin != timeline.net.size(); ++bin)
+        {
+            net += timeline.net[bin];
+            min_net = std::min(min_net, net);
+            max_net = std::max(max_net, net);
+            timeline_net[bin] = net;
+        }
+        for (std::size_t bin = 0; bin != timeline_net.size(); ++bin)
+            timeline_live[bin] = timeline_net[bin] - min_net;
+        auto print_totals = [&]() -> MemStatsFormatter &
+        {
+            out << " | ";
+            out.column().bytes(total_bytes).right(6) << '(';
+            return out.column().count(total_count).left(5) << ") | ";
+        };
+
+        const double duration = bin_seconds * timeline.count.size();
+        format_bins(timeline.count).column().count(rate(max_count)) << "/s";
+        out.left(6);
+        print_totals() << "Timeline allocations/s over ";
+        out.fixed(duration, 3) << "s\n";
+        format_bins(timeline.bytes).column().bytes(rate(max_bytes)) << "/s";
+        out.left(6);
+        print_totals() << "Timeline bytes/s over ";
+        out.fixed(duration, 3) << "s\n";
+        if (timeline.net_known)
+        {
+            format_bins(timeline_live).column().signed_bytes(max_net).left(6) << " | ";
+            out.column().signed_bytes(net).right(6) << "       | Timeline net live bytes\n";
+        }
+    }
+    out.write();
+
+    // avoid printing legend several times, so call once at exit
+    static std::once_flag legend_flag;
+    std::call_once(legend_flag, []()
+                    { std::atexit(print_legend); });
+}
+
+/** Takes the stored events of every thread, drains the chunks handed over to the drain thread, and writes them
+ * to the trace file, if any.
+ * Threads are taken first, then only the chunks they started before being taken are drained, the ones handed over
+ * afterwards are left to the next report. When tracing, this is the cut written by the report to the trace file.
+ * Drained chunks are written out first, they hold older events. Must be called with 'memstats_lock' held.
+ */
+vector<MemStatsTaken> memstats_take_all()
+{
+    vector<MemStatsTaken> taken;
+    for (MemStatsThread *thread_events = memstats_threads.load(std::memory_order_acquire); thread_events; thread_events = thread_events->next)
+    {
+        const unsigned char state = thread_events->state.load(std::memory_order_acquire);
+        // chunks started after this load and not taken now are only started once the thread sees its list taken
+        const std::uint64_t started = memstats_chunk_sequence.load(std::memory_order_relaxed);
+        taken.push_back(MemStatsTaken{thread_events, thread_events->take(), state, started});
+    }
+    // a single barrier for all the threads, see 'MemStatsThread::begin_write'
+    memstats_barrier();
+    for (MemStatsTaken &item : taken)
+    {
+        item.thread->settle();
+        // chunks are only numbered when tracing, all the ones handed over are drained otherwise
+        if (not memstats_trace_path)
+            item.cut = std::numeric_limits<std::uint64_t>::max();
+        for (const MemStatsChunk *chunk = item.chunks; chunk and memstats_trace_path; chunk = chunk->next)
+            item.cut = std::max(item.cut, chunk->sequence + 1);
+    }
+    for (const MemStatsTaken &item : taken)
+        memstats_drain(*item.thread, item.cut);
+    for (const MemStatsTaken &item : taken)
+        memstats_trace_write(item.thread->thread, item.chunks);
+    return taken;
+}
+
+/** Folds the chunks taken from the threads into their statistics, spreading them over worker threads
+ * at exit or with 'MEMSTATS_PARALLEL_FOLD'.
+ * Each chunk is aggregated on its own and merged into its thread afterwards, so that a single thread with many events
+ * is split as well. Sampled allocations get a random state per chunk, drawn from the one of their thread.
+ * Only the taken chunks are given back, events recorded meanwhile (e.g. by the worker threads) are left to the next report.
+ * Must be called with 'memstats_lock' held.
+ */
+void memstats_fold_all(const vector<MemStatsTaken> &taken)
+{
+    struct Work
+    {
+        MemStatsThread *thread;
+        const MemStatsChunk *chunk;
+        MemStatsAggregate partial;
+    };
+    vector<Work> work;
+    for (const MemStatsTaken &item : taken)
+        for (const MemStatsChunk *chunk = item.chunks; chunk; chunk = chunk->next)
+            if (chunk->size)
+            {
+                work.push_back(Work{item.thread, chunk, MemStatsAggregate{}});
+                work.back().partial.random_state = memstats_random(item.thread->folded.random_state) | 1;
+            }
+
+    auto fold = [&work](std::size_t i)
+    {
+        // allocations of the worker threads must not be recorded while their buffers are being folded
+        const MemStatsBusyGuard busy;
+        MemStatsAggregate &partial = work[i].partial;
+        work[i].chunk->for_each([&partial](const MemStatsInfo &info) { partial.add(info); });
+    };
+    // Worker threads only pay off with a few chunks to fold on each. Nothing is recorded anymore by the report at exit,
+    // so it always uses them. Otherwise they are opt-in, and never used with 'memstats_preload', where their own
+    // allocations would go through the instrumented 'malloc'.
+    const bool exiting = not memstats_instrumentation_global.load(std::memory_order_acquire);
+#if MEMSTAT_PRELOAD
+    const bool parallel = exiting;
+#else
+    const bool parallel = exiting or memstats_parallel_fold;
+#endif
+    const std::size_t workers = parallel ? std::min<std::size_t>(std::thread::hardware_concurrency(), work.size() / 4) : 1;
+    if (workers <= 1)
+        for (std::size_t i = 0; i != work.size(); ++i)
+            fold(i);
+#if MEMSTAT_HAVE_TBB
+    // the scheduler of TBB may be shut down already while the program exits
+    else if (not exiting)
+        tbb::parallel_for(std::size_t(0), work.size(), fold);
+#endif
+    else
+    {
+        std::atomic<std::size_t> index{0};
+        auto worker = [&]
+        {
+            for (std::size_t i = index.fetch_add(1, std::memory_order_relaxed); i < work.size(); i = index.fetch_add(1, std::memory_order_relaxed))
+                fold(i);
+        };
+        vector<std::thread> threads;
+        for (std::size_t i = 1; i != workers; ++i)
+            threads.emplace_back(worker);
+        worker();
+        for (std::thread &thread : threads)
+            thread.join();
+    }
+
+    for (const Work &item : work)
+        item.thread->folded.merge(item.partial);
+    for (const MemStatsTaken &item : taken)
+        item.thread->give_spare(item.chunks);
+}
+
+void memstats_trace_sync()
+{
+    if (not memstats_trace_path)
+        return;
+    auto lock = std::unique_lock<std::recursive_mutex>{memstats_lock};
+    // events written out are folded, as threads writing out their own chunks do
+    memstats_fold_all(memstats_take_all());
+}
+
+// Gathers the allocations within no-alloc scopes pushed to the ring since the last report, and counts the ones that were
+// overwritten before being read. Must be called with 'memstats_lock' held.
+void memstats_noalloc_rows(MemStatsReport &report)
+{
+    using Key = std::pair<const char *, std::uint32_t>;
+    vector<std::pair<Key, std::size_t>> logged;
+    const std::size_t first = memstats_noalloc_reported;
+    memstats_noalloc_reported = memstats_noalloc_ring.for_each(first, [&](const char *scope, std::size_t size, std::uint32_t stack)
+    {
+        logged.push_back(std::make_pair(Key{scope, stack}, size));
+    });
+    // the indices read cover every push since the last report, later pushes are left to the next one
+    report.noalloc_unlogged = memstats_noalloc_reported - first - logged.size();
+    if (logged.empty())
+        return;
+    // scopes are grouped by name, the same name may be given by different string literals
+    std::sort(logged.begin(), logged.end(), [](const std::pair<Key, std::size_t> &a, const std::pair<Key, std::size_t> &b)
+    {
+        const int order = std::strcmp(a.first.first, b.first.first);
+        return order ? order < 0 : a.first.second < b.first.second;
+    });
+    vector<std::pair<Key, Stats>> grouped;
+    for (const auto &entry : logged)
+    {
+        if (grouped.empty() or grouped.back().first.second != entry.first.second or std::strcmp(grouped.back().first.first, entry.first.first))
+            grouped.push_back(std::make_pair(entry.first, Stats{}));
+        grouped.back().second.add(entry.second);
+    }
+    memstats_rank_rows(grouped, report.noalloc, [](const Key &key)
+    {
+        return "'" + string(key.first) + "' " + memstats_stack_label(key.second);
+    });
+}
+
+/** Builds and prints a report of the running program.
+ * The chunk list and statistics of each thread are taken as a whole, threads recording meanwhile continue on new ones,
+ * so the report covers every event recorded up to the call without stopping the other threads.
+ */
+void memstats_make_report(const char *report_name)
+{
+    auto lock = std::unique_lock<std::recursive_mutex>{memstats_lock};
+    // the drained statistics are read and cleared below
+    auto drained_lock = std::unique_lock<std::recursive_mutex>{memstats_drained_lock};
+    const MemStatsBusyGuard busy;
+    MemStatsReport report;
+
+    // chunks handed over to the drain thread are folded, and stored events are taken and written out before they get folded
+    const vector<MemStatsTaken> taken = memstats_take_all();
+
+    // row of each thread id, buffers of finished threads may share their id with newer ones
+    unordered_map<std::thread::id, std::size_t> thread_rows;
+    report.latency = memstats_latency;
+    report.lifetime = memstats_lifetime;
+    unordered_map<std::uint32_t, Stats> region_stats;
+#if MEMSTAT_HAVE_STACKTRACE
+    unordered_map<std::stacktrace_entry, Stats> stacktrace_entry_stats;
+    unordered_map<std::stacktrace_entry, MemStatsLatency> stacktrace_entry_latency;
+    unordered_map<std::stacktrace_entry, DurationStats> stacktrace_entry_lifetime;
+#endif
+    memstats_fold_all(taken);
+    // events over time of every thread, whichever way they were folded
+    MemStatsSeries series;
+    for (const MemStatsTaken &item : taken)
+    {
+        // vacant buffers were cleared when retired, claimed ones are not recording yet
+        if (item.state != MemStatsThread::active and item.state != MemStatsThread::retired)
+            continue;
+        MemStatsThread *thread_events = item.thread;
+        thread_events->folded.merge(thread_events->drained);
+        const MemStatsAggregate &aggregate = thread_events->folded;
+        series.merge(aggregate.series);
+        const Stats &stats = aggregate.stats;
+        report.total.merge(stats);
+        auto row = thread_rows.emplace(thread_events->thread, report.threads.size());
+        if (row.second)
+        {
+            report.threads.push_back(MemStatsRow{memstats_to_string(thread_events->thread), Stats{}, 0});
+            report.latency_threads.push_back(MemStatsLatencyRow{report.threads.back().label, MemStatsLatency{}});
+        }
+        report.threads[row.first->second].stats.merge(stats);
+        if (report.latency)
+        {
+            report.latency_total.merge(aggregate.latency);
+            report.latency_threads[row.first->second].latency.merge(aggregate.latency);
+        }
+        report.lifetime_total.merge(aggregate.lifetime);
+        for (const auto &pair : aggregate.region_stats)
+            region_stats[pair.first].merge(pair.second);
+#if MEMSTAT_HAVE_STACKTRACE
+        for (const auto &pair : aggregate.stack_stats)
+            if (pair.first)
+                for (auto entry : memstats_stacks[pair.first])
+                    stacktrace_entry_stats[entry].merge(pair.second);
+        for (const auto &pair : aggregate.stack_latency)
+            if (pair.first)
+                for (auto entry : memstats_stacks[pair.first])
+                    stacktrace_entry_latency[entry].merge(pair.second);
+        for (const auto &pair : aggregate.stack_lifetime)
+            if (pair.first)
+                for (auto entry : memstats_stacks[pair.first])
+                    stacktrace_entry_lifetime[entry].merge(pair.second);
+#endif
+        // clean up thread buffer
+        thread_events->clear();
+        if (item.state == MemStatsThread::retired)
+            thread_events->state.store(MemStatsThread::vacant, std::memory_order_release);
+    }
+    memstats_noalloc_rows(report);
+    if (report.total.count == 0 and report.noalloc.empty() and not report.noalloc_unlogged)
+        return;
+    report.timeline.tick_seconds = memstats_tick_seconds();
+    if (memstats_timeline and report.timeline.tick_seconds > 0.)
+    {
+        report.timeline.assign(series, memstats_bins());
+        // deallocations are only recorded when not sampling
+        report.timeline.net_known = not series.unsized and not memstats_sample_interval;
+    }
+    if (not region_stats.empty())
+        memstats_region_rows(region_stats, memstats_regions.nodes(), report.regions);
+#if MEMSTAT_HAVE_STACKTRACE
+    memstats_rank_rows(stacktrace_entry_stats, report.frames, memstats_frame_label);
+    memstats_rank_latency_frames(stacktrace_entry_latency, report.latency_frames, memstats_frame_label);
+    if (report.timeline.tick_seconds > 0.)
+        memstats_rank_lifetime_frames(stacktrace_entry_lifetime, report.lifetime_frames,
+                                      std::size_t(memstats_lifetime_threshold() / report.timeline.tick_seconds), memstats_frame_label);
+#endif
+
+    if (memstats_track_live)
+    {
+        // live blocks are not flushed by the report, they stay live until deallocated
+        report.live = true;
+        unordered_map<std::thread::id, Stats> live_thread_stats;
+#if MEMSTAT_HAVE_STACKTRACE
+        unordered_map<std::stacktrace_entry, Stats> live_stacktrace_entry_stats;
+#endif
+        memstats_live_table.for_each([&](const MemStatsLiveBlock &block)
+        {
+            report.live_total.stats.add(block.size, block.weight);
+            live_thread_stats[block.thread].add(block.size, block.weight);
+#if MEMSTAT_HAVE_STACKTRACE
+            if (block.stack)
+                for (auto entry : memstats_stacks[block.stack])
+                    live_stacktrace_entry_stats[entry].add(block.size, block.weight);
+#endif
+        });
+
+        // high-water marks are restarted from the current live bytes
+        report.live_total.peak = memstats_peak_bytes.exchange(memstats_live_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        for (MemStatsThread *thread_events = memstats_threads.load(std::memory_order_acquire); thread_events; thread_events = thread_events->next)
+        {
+            const std::size_t thread_peak = thread_events->peak_bytes.exchange(thread_events->live_bytes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            // the id of vacant buffers may be rewritten by a thread claiming them, retired ones are only made vacant under 'memstats_lock'
+            if (thread_events->state.load(std::memory_order_acquire) != MemStatsThread::active)
+                continue;
+            auto it = live_thread_stats.find(thread_events->thread);
+            if (it != live_thread_stats.end())
+            {
+                report.live_threads.push_back(MemStatsRow{memstats_to_string(thread_events->thread), it->second, thread_peak});
+                live_thread_stats.erase(it);
+            }
+        }
+        // the rest belongs to threads that exited, whose high-water mark is not tracked
+        for (const auto &pair : live_thread_stats)
+            report.live_threads.push_back(MemStatsRow{memstats_to_string(pair.first), pair.second, 0});
+#if MEMSTAT_HAVE_STACKTRACE
+        memstats_rank_rows(live_stacktrace_entry_stats, report.live_frames, memstats_frame_label);
+#endif
+    }
+
+    memstats_trace_report(report_name, taken);
+    memstats_print_report(report_name, report);
+}
+
+MEMSTATS_EXPORT void memstats_report(const char * report_name)
+{
+    memstats_make_report(report_name);
+}
+
+MEMSTATS_EXPORT void memstats_snapshot(const char * report_name)
+{
+    // deprecated alias, reports do not stop the other threads
+    memstats_make_report(report_name);
+}
+
+/** Report of the allocations that are still live, grouped by the thread and by the whole stacktrace that allocated them.
+ * Blocks are visited once and accumulated into hash maps, so the cost is linear in the number of live blocks.
+ * At exit, blocks of objects destroyed after this report (e.g. static objects constructed before 'memstats_at_exit_guard') are listed too.
+ */
+void memstats_report_leaks()
+{
+    auto lock = std::unique_lock<std::recursive_mutex>{memstats_lock};
+    const MemStatsBusyGuard busy;
+    MemStatsReport report;
+    unordered_map<std::thread::id, Stats> thread_stats;
+    unordered_map<std::uint32_t, Stats> stack_stats;
+    memstats_live_table.for_each([&](const MemStatsLiveBlock &block)
+    {
+        report.total.add(block.size, block.weight);
+        thread_stats[block.thread].add(block.size, block.weight);
+        stack_stats[block.stack].add(block.size, block.weight);
+    });
+    memstats_rank_rows(thread_stats, report.threads, [](std::thread::id thread)
+    {
+        return memstats_to_string(thread);
+    });
+    memstats_rank_rows(stack_stats, report.frames, [](std::uint32_t stack)
+    {
+        return "Leak " + memstats_stack_label(stack);
+    });
+    memstats_print_report("leaks", report);
+}
+
+// read-only view of a whole file
+class MemStatsFileView
+{
+public:
+    const unsigned char *data = nullptr;
+    std::size_t size = 0;
+
+    explicit MemStatsFileView(const char *path)
+    {
+#if MEMSTATS_MMAP
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat status;
+        if (::fstat(fd, &status) == 0 and status.st_size > 0)
+        {
+            void *map = ::mmap(nullptr, std::size_t(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                data = static_cast<const unsigned char *>(map);
+                size = std::size_t(status.st_size);
+            }
+        }
+        ::close(fd);
+#else
+        std::FILE *file = std::fopen(path, "rb");
+        if (not file)
+            return;
+        if (std::fseek(file, 0, SEEK_END) == 0)
+        {
+            const long length = std::ftell(file);
+            if (length > 0 and std::fseek(file, 0, SEEK_SET) == 0)
+            {
+                buffer.resize(std::size_t(length));
+                if (std::fread(buffer.data(), 1, buffer.size(), file) == buffer.size())
+                {
+                    data = buffer.data();
+                    size = buffer.size();
+                }
+            }
+        }
+        std::fclose(file);
+#endif
+    }
+
+    ~MemStatsFileView()
+    {
+#if MEMSTATS_MMAP
+        if (data)
+            ::munmap(const_cast<unsigned char *>(data), size);
+#endif
+    }
+
+    MemStatsFileView(const MemStatsFileView &) = delete;
+    MemStatsFileView &operator=(const MemStatsFileView &) = delete;
+
+private:
+#if !MEMSTATS_MMAP
+    vector<unsigned char> buffer;
+#endif
+};
+
+/** Rebuilds the reports of a trace.
+ * Events are replayed in time order, the live heap is carried from one report to the next one as in the traced program.
+ * A report gets the events written before it, except the ones of chunks past the cut of their thread, which are left
+ * to the next report as they were in the traced program.
+ */
+class MemStatsTraceReplay
+{
+    struct LiveBlock
+    {
+        std::size_t size, weight;
+        std::uint32_t thread, stack;
+        std::int64_t time;
+    };
+
+    // decoded event, with the thread index and the region id of the replay
+    struct Event
+    {
+        std::uint64_t ptr, size, latency;
+        std::int64_t time;
+        // sequence number of the chunk
+        std::uint64_t sequence;
+        std::uint32_t thread, stack, region;
+        std::uint16_t size_class;
+        MemStatsOperation operation;
+        bool timed;
+    };
+
+    const MemStatsTraceHeader header;
+    // latest calibration of the timestamps
+    double tick_seconds;
+    // labels of threads by index, starting with an unused one, and of frames by address
+    vector<string> threads = vector<string>(1);
+    unordered_map<std::uint64_t, string> frames;
+    // frame addresses of each stack by id, pointing into the trace
+    unordered_map<std::uint32_t, std::pair<const std::uint64_t *, std::uint32_t>> stacks;
+    // tree of regions, starting with the root, and their index by id in the trace
+    vector<MemStatsRegionNode> regions = vector<MemStatsRegionNode>(1, MemStatsRegionNode{0, string()});
+    unordered_map<std::uint32_t, std::uint32_t> region_ids;
+    // events not reported yet
+    vector<Event> events;
+    // per thread index
+    vector<std::uint64_t> random_state = vector<std::uint64_t>(1);
+    vector<std::size_t> thread_live = vector<std::size_t>(1), thread_peak = vector<std::size_t>(1);
+    unordered_map<std::uint64_t, LiveBlock> live;
+    std::size_t live_bytes = 0, peak_bytes = 0;
+
+    // index of region 'id' of the trace, or false if it was not written before
+    bool region_index(std::uint32_t id, std::uint32_t &index) const
+    {
+        if (not id)
+        {
+            index = 0;
+            return true;
+        }
+        auto it = region_ids.find(id);
+        if (it == region_ids.end())
+            return false;
+        index = it->second;
+        return true;
+    }
+
+    // calls 'f' with the address of each frame of a stack
+    template <class F>
+    void for_each_frame(std::uint32_t stack, F f) const
+    {
+        auto it = stacks.find(stack);
+        if (it != stacks.end())
+            for (std::uint32_t i = 0; i != it->second.second; ++i)
+                f(it->second.first[i]);
+    }
+
+    string frame_label(std::uint64_t address) const
+    {
+        auto it = frames.find(address);
+        return it != frames.end() ? it->second : MemStatsFormatter{}.hex(address).str();
+    }
+
+    void release(const LiveBlock &block)
+    {
+        thread_live[block.thread] -= block.size * block.weight;
+        live_bytes -= block.size * block.weight;
+    }
+
+public:
+    explicit MemStatsTraceReplay(const MemStatsTraceHeader &header)
+        : header(header), tick_seconds(header.tick_seconds)
+    {
+    }
+
+    // reads a block, returns false if it is malformed
+    bool read(const MemStatsTraceBlock &block, const unsigned char *payload)
+    {
+        switch (MemStatsTraceBlockType(block.type))
+        {
+        case MemStatsTraceBlockType::events:
+        {
+            MemStatsTraceEvents chunk;
+            if (block.size < sizeof chunk or (block.size - sizeof chunk) % sizeof(MemStatsPackedInfo))
+                return false;
+            std::memcpy(&chunk, payload, sizeof chunk);
+            // threads are written before their events
+            if (not chunk.thread or chunk.thread >= threads.size())
+                return false;
+            const std::size_t first = events.size();
+            bool valid = true;
+            const bool decoded = memstats_decode(reinterpret_cast<const MemStatsPackedInfo *>(payload + sizeof chunk),
+                                    (block.size - sizeof chunk) / sizeof(MemStatsPackedInfo), chunk.time, chunk.region,
+                                    [&](const MemStatsInfo &info)
+            {
+                // so are the stacks and regions the events refer to
+                std::uint32_t region;
+                if (not region_index(info.region, region) or (info.stack and not stacks.count(info.stack)))
+                    valid = false;
+                else
+                    events.push_back(Event{std::uint64_t(std::uintptr_t(info.ptr)), info.size, info.latency, info.time,
+                                           chunk.sequence, chunk.thread, info.stack, region, std::uint16_t(info.size_class), info.operation, info.timed});
+            });
+            if (decoded and valid)
+                return true;
+            events.resize(first);
+            return false;
+        }
+        case MemStatsTraceBlockType::thread:
+        {
+            std::uint32_t index;
+            if (block.size < 2 * sizeof index)
+                return false;
+            std::memcpy(&index, payload, sizeof index);
+            // indices are given in order, a thread may only be labeled again
+            if (not index or index > threads.size())
+                return false;
+            if (index == threads.size())
+            {
+                threads.emplace_back();
+                random_state.push_back(0x9E3779B97F4A7C15ULL);
+                thread_live.push_back(0);
+                thread_peak.push_back(0);
+            }
+            const char *label = reinterpret_cast<const char *>(payload + 2 * sizeof index);
+            threads[index].assign(label, block.size - 2 * sizeof index);
+            return true;
+        }
+        case MemStatsTraceBlockType::frame:
+        {
+            std::uint64_t address;
+            if (block.size < sizeof address)
+                return false;
+            std::memcpy(&address, payload, sizeof address);
+            const char *label = reinterpret_cast<const char *>(payload + sizeof address);
+            frames[address].assign(label, block.size - sizeof address);
+            return true;
+        }
+        case MemStatsTraceBlockType::stack:
+        {
+            std::uint32_t header[2];
+            if (block.size < sizeof header)
+                return false;
+            std::memcpy(header, payload, sizeof header);
+            if (not header[0] or (block.size - sizeof header) / sizeof(std::uint64_t) < header[1])
+                return false;
+            stacks[header[0]] = std::make_pair(reinterpret_cast<const std::uint64_t *>(payload + sizeof header), header[1]);
+            return true;
+        }
+        case MemStatsTraceBlockType::region:
+        {
+            std::uint32_t header[2], parent;
+            if (block.size < sizeof header)
+                return false;
+            std::memcpy(header, payload, sizeof header);
+            // parents are written first, which also rules out cycles
+            if (not header[0] or region_ids.count(header[0]) or not region_index(header[1], parent))
+                return false;
+            region_ids.emplace(header[0], std::uint32_t(regions.size()));
+            regions.push_back(MemStatsRegionNode{parent, string(reinterpret_cast<const char *>(payload + sizeof header), block.size - sizeof header)});
+            return true;
+        }
+        case MemStatsTraceBlockType::clock:
+            if (block.size < sizeof tick_seconds)
+                return false;
+            std::memcpy(&tick_seconds, payload, sizeof tick_seconds);
+            return true;
+        case MemStatsTraceBlockType::report:
+        {
+            std::uint32_t header[2];
+            if (block.size < sizeof header)
+                return false;
+            std::memcpy(header, payload, sizeof header);
+            if ((block.size - sizeof header) / sizeof(MemStatsTraceCut) < header[0])
+                return false;
+            // threads without a cut are reported as a whole. The id of an exited thread may be reused by a new one
+            // taken by the same report, the largest cut is then kept
+            vector<std::uint64_t> cuts(threads.size(), std::numeric_limits<std::uint64_t>::max());
+            vector<bool> cut(threads.size());
+            for (std::uint32_t i = 0; i != header[0]; ++i)
+            {
+                MemStatsTraceCut thread_cut;
+                std::memcpy(&thread_cut, payload + sizeof header + i * sizeof thread_cut, sizeof thread_cut);
+                if (not thread_cut.thread or thread_cut.thread >= threads.size())
+                    return false;
+                cuts[thread_cut.thread] = cut[thread_cut.thread] ? std::max(cuts[thread_cut.thread], thread_cut.sequence) : thread_cut.sequence;
+                cut[thread_cut.thread] = true;
+            }
+            auto later = std::stable_partition(events.begin(), events.end(), [&cuts](const Event &event)
+            {
+                return event.sequence < cuts[event.thread];
+            });
+            vector<Event> pending(later, events.end());
+            events.erase(later, events.end());
+            const std::size_t name = sizeof header + header[0] * sizeof(MemStatsTraceCut);
+            print(string(reinterpret_cast<const char *>(payload + name), block.size - name).c_str());
+            events = std::move(pending);
+            return true;
+        }
+        }
+        return false;
+    }
+
+    // reports the events since the last report
+    void print(const char *report_name)
+    {
+        std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b)
+        {
+            return a.time < b.time;
+        });
+        MemStatsReport report;
+        report.timeline.tick_seconds = tick_seconds;
+        const bool timeline = tick_seconds > 0. and memstats_timeline;
+        const auto bins = memstats_bins();
+        if (timeline)
+            for (const Event &event : events)
+                report.timeline.extend(event.time);
+
+        vector<Stats> thread_stats(threads.size());
+        unordered_map<std::uint32_t, Stats> stack_stats, region_stats;
+        const bool track_live = header.flags & memstats_trace_live;
+        report.latency = header.flags & memstats_trace_latency;
+        vector<MemStatsLatency> thread_latency(threads.size());
+        unordered_map<std::uint32_t, MemStatsLatency> stack_latency;
+        report.lifetime = track_live and (header.flags & memstats_trace_lifetime);
+        unordered_map<std::uint32_t, DurationStats> stack_lifetime;
+        for (const Event &event : events)
+        {
+            const std::size_t size = event.size;
+            std::size_t n = 0;
+            if (event.operation == MemStatsOperation::allocation and size)
+            {
+                n = memstats_sample_weight(size, header.sample_interval, random_state[event.thread]);
+                report.total.add(size, n, event.size_class);
+                thread_stats[event.thread].add(size, n, event.size_class);
+                stack_stats[event.stack].add(size, n, event.size_class);
+                if (event.region)
+                    region_stats[event.region].add(size, n, event.size_class);
+                if (track_live)
+                {
+                    auto it = live.find(event.ptr);
+                    if (it != live.end())
+                        release(it->second);
+                    live[event.ptr] = LiveBlock{size, n, event.thread, event.stack, event.time};
+                    thread_live[event.thread] += size * n;
+                    thread_peak[event.thread] = std::max(thread_peak[event.thread], thread_live[event.thread]);
+                    live_bytes += size * n;
+                    peak_bytes = std::max(peak_bytes, live_bytes);
+                }
+            }
+            else if (event.operation == MemStatsOperation::deallocation and track_live)
+            {
+                auto it = live.find(event.ptr);
+                if (it != live.end())
+                {
+                    const LiveBlock &block = it->second;
+                    if (report.lifetime)
+                    {
+                        const std::size_t lifetime = std::size_t(std::max<std::int64_t>(event.time - block.time, 0));
+                        report.lifetime_total.add(lifetime, block.weight);
+                        stack_lifetime[block.stack].add(lifetime, block.weight);
+                    }
+                    release(block);
+                    live.erase(it);
+                }
+            }
+            if (report.latency and event.timed and (event.operation == MemStatsOperation::deallocation or n))
+            {
+                // deallocations are only recorded when not sampling
+                const std::size_t weight = event.operation == MemStatsOperation::allocation ? n : 1;
+                report.latency_total.add(event.operation, event.latency, weight);
+                thread_latency[event.thread].add(event.operation, event.latency, weight);
+                stack_latency[event.stack].add(event.operation, event.latency, weight);
+            }
+            if (timeline)
+            {
+                report.timeline.add(bins, event.time, event.operation, size, n);
+                // deallocations are only recorded when not sampling
+                if (event.operation == MemStatsOperation::deallocation and not size)
+                    report.timeline.net_known = false;
+            }
+        }
+        report.timeline.net_known = report.timeline.net_known and not header.sample_interval;
+        events.clear();
+        if (report.total.count == 0)
+            return;
+
+        for (std::size_t index = 1; index < threads.size(); ++index)
+            if (thread_stats[index].count)
+                report.threads.push_back(MemStatsRow{threads[index], thread_stats[index], 0});
+        unordered_map<std::uint64_t, Stats> frame_stats;
+        for (const auto &pair : stack_stats)
+            for_each_frame(pair.first, [&](std::uint64_t address) { frame_stats[address].merge(pair.second); });
+        auto label = [this](std::uint64_t address) { return frame_label(address); };
+        memstats_rank_rows(frame_stats, report.frames, label);
+        memstats_region_rows(region_stats, regions, report.regions);
+
+        if (report.latency)
+        {
+            for (std::size_t index = 1; index < threads.size(); ++index)
+                if (thread_latency[index].allocation.count or thread_latency[index].deallocation.count)
+                    report.latency_threads.push_back(MemStatsLatencyRow{threads[index], thread_latency[index]});
+            unordered_map<std::uint64_t, MemStatsLatency> frame_latency;
+            for (const auto &pair : stack_latency)
+                for_each_frame(pair.first, [&](std::uint64_t address) { frame_latency[address].merge(pair.second); });
+            memstats_rank_latency_frames(frame_latency, report.latency_frames, label);
+        }
+
+        if (report.lifetime and tick_seconds > 0.)
+        {
+            unordered_map<std::uint64_t, DurationStats> frame_lifetime;
+            for (const auto &pair : stack_lifetime)
+                for_each_frame(pair.first, [&](std::uint64_t address) { frame_lifetime[address].merge(pair.second); });
+            memstats_rank_lifetime_frames(frame_lifetime, report.lifetime_frames, std::size_t(memstats_lifetime_threshold() / tick_seconds), label);
+        }
+
+        if (track_live)
+        {
+            report.live = true;
+            vector<Stats> live_thread_stats(threads.size());
+            unordered_map<std::uint64_t, Stats> live_frame_stats;
+            for (const auto &pair : live)
+            {
+                const LiveBlock &block = pair.second;
+                report.live_total.stats.add(block.size, block.weight);
+                live_thread_stats[block.thread].add(block.size, block.weight);
+                for_each_frame(block.stack, [&](std::uint64_t address) { live_frame_stats[address].add(block.size, block.weight); });
+            }
+            // high-water marks are restarted from the current live bytes
+            report.live_total.peak = peak_bytes;
+            peak_bytes = live_bytes;
+            for (std::size_t index = 1; index < threads.size(); ++index)
+            {
+                if (live_thread_stats[index].count)
+                    report.live_threads.push_back(MemStatsRow{threads[index], live_thread_stats[index], thread_peak[index]});
+                thread_peak[index] = thread_live[index];
+            }
+            memstats_rank_rows(live_frame_stats, report.live_frames, label);
+        }
+        memstats_print_report(report_name, report);
+    }
+
+    // reports the blocks still live at the end of the trace, like 'memstats_report_leaks'
+    void print_leaks()
+    {
+        MemStatsReport report;
+        unordered_map<std::uint32_t, Stats> thread_stats, stack_stats;
+        for (const auto &pair : live)
+        {
+            const LiveBlock &block = pair.second;
+            report.total.add(block.size, block.weight);
+            thread_stats[block.thread].add(block.size, block.weight);
+            stack_stats[block.stack].add(block.size, block.weight);
+        }
+        memstats_rank_rows(thread_stats, report.threads, [this](std::uint32_t index) { return threads[index]; });
+        memstats_rank_rows(stack_stats, report.frames, [this](std::uint32_t stack)
+        {
+            MemStatsFormatter label;
+            label << "Leak stack ";
+            if (stack)
+                label.integer(stack);
+            else
+                label << "unknown";
+            for_each_frame(stack, [&](std::uint64_t address) { label << "\n        " << frame_label(address); });
+            return label.str();
+        });
+        memstats_print_report("leaks", report);
+    }
+};
+
+MEMSTATS_EXPORT bool memstats_report_trace(const char *trace_path)
+{
+    auto lock = std::unique_lock<std::recursive_mutex>{memstats_lock};
+    const MemStatsBusyGuard busy;
+    const MemStatsFileView file{trace_path};
+    if (not file.data)
+    {
+        std::cerr << "MemStats trace file '" << trace_path << "' could not be read\n";
+        return false;
+    }
+    MemStatsTraceHeader header;
+    if (file.size < sizeof header)
+    {
+        std::cerr << "MemStats trace file '" << trace_path << "' is not a trace\n";
+        return false;
+    }
+    std::memcpy(&header, file.data, sizeof header);
+    if (std::memcmp(header.magic, memstats_trace_magic, sizeof header.magic) != 0 or header.version != memstats_trace_version)
+    {
+        std::cerr << "MemStats trace file '" << trace_path << "' is not a trace of version " << memstats_trace_version << "\n";
+        return false;
+    }
+
+    // blocks are 8-byte aligned within the file, so records and frame addresses are read in place
+    MemStatsTraceReplay replay{header};
+    std::size_t offset = sizeof header;
+    while (offset != file.size)
+    {
+        MemStatsTraceBlock block;
+        bool valid = file.size - offset >= sizeof block;
+        if (valid)
+        {
+            std::memcpy(&block, file.data + offset, sizeof block);
+            valid = file.size - offset - sizeof block >= memstats_trace_padded(block.size) and replay.read(block, file.data + offset + sizeof block);
+        }
+        if (not valid)
+        {
+            std::cerr << "MemStats trace file '" << trace_path << "' is corrupted at byte " << offset << "\n";
+            break;
+        }
+        offset += sizeof block + memstats_trace_padded(block.size);
+    }
+    // events after the last report, e.g. when the program did not exit normally
+    replay.print("trace");
+    if (memstats_leak_report and (header.flags & memstats_trace_live))
+        replay.print_leaks();
+    return true;
+}
+
+template<class T, class U = T>
+T exchange(T& obj, U&& new_value)
+{
+    T old_value = std::move(obj);
+    obj = std::forward<U>(new_value);
+    return old_value;
+}
+
+MEMSTATS_EXPORT void memstats_region_begin(const char *name)
+{
+    if (memstats_region_depth < memstats_region_capacity)
+        memstats_region_stack[memstats_region_depth] = memstats_regions.find_or_insert(memstats_current_region(), name ? name : "");
+    ++memstats_region_depth;
+}
+
+MEMSTATS_EXPORT void memstats_region_end()
+{
+    if (memstats_region_depth)
+        --memstats_region_depth;
+}
+
+MEMSTATS_EXPORT void memstats_noalloc_begin(const char *name)
+{
+    if (memstats_noalloc_depth < memstats_region_capacity)
+    {
+        memstats_noalloc_scope[memstats_noalloc_depth] = name ? name : "";
+        memstats_noalloc_start[memstats_noalloc_depth] = memstats_noalloc_count;
+    }
+    ++memstats_noalloc_depth;
+}
+
+MEMSTATS_EXPORT std::size_t memstats_noalloc_end()
+{
+    if (not memstats_noalloc_depth)
+        return 0;
+    --memstats_noalloc_depth;
+    return memstats_noalloc_count - memstats_noalloc_start[std::min(memstats_noalloc_depth, memstats_region_capacity - 1)];
+}
+
+MEMSTATS_EXPORT void memstats_thread_counters(void (*callback)(const memstats_counters *counters, void *data), void *data)
+{
+    // buffers are never removed from the registry and their counters are atomic, so it is walked without locking.
+    // Exiting threads add their counters to the exited ones before retiring, so they may be seen twice meanwhile.
+    for (MemStatsThread *thread_events = memstats_threads.load(std::memory_order_acquire); thread_events; thread_events = thread_events->next)
+    {
+        const MemStatsCounters &counters = thread_events->counters;
+        const std::size_t thread = counters.thread.load(std::memory_order_acquire);
+        if (not thread)
+            continue;
+        memstats_counters copy;
+        memstats_copy_counters(counters, thread, copy);
+        // skipped if the buffer was retired meanwhile, its counters may have been reset for another thread
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (counters.thread.load(std::memory_order_relaxed) == thread)
+            callback(&copy, data);
+    }
+    memstats_counters exited;
+    memstats_copy_counters(memstats_exited_counters, 0, exited);
+    if (exited.allocations or exited.deallocations)
+        callback(&exited, data);
+}
+
+MEMSTATS_EXPORT bool memstats_enable_thread_instrumentation()
+{
+    return exchange(memstats_instrumentation_thread, true);
+}
+
+MEMSTATS_EXPORT bool memstats_disable_thread_instrumentation()
+{
+    return exchange(memstats_instrumentation_thread, false);
+}
 
 bool memstats_do_instrument()
 {
-    return memstats_instrumentation_thread and memstats_instrumentation_global.load(std::memory_order_acquire);
+    // the global switch goes first: until it is enabled, thread-local variables with dynamic initialization are not touched
+    return memstats_instrumentation_global.load(std::memory_order_acquire) and not memstats_thread_busy and not memstats_thread_exited
+        and memstats_instrumentation_thread;
 }
 
-// instrumentation of new
-void *operator new(std::size_t sz)
+// Whether the deallocation of a live block of 'freed' bytes has to be recorded even if it is not instrumented otherwise,
+// i.e. when it is traced or its lifetime is measured
+bool memstats_record_free_of_live(std::size_t freed)
+{
+    return freed and (memstats_trace_path or memstats_lifetime) and memstats_instrumentation_global.load(std::memory_order_acquire) and not memstats_thread_busy
+        and not memstats_thread_exited;
+}
+
+// Thread-local sampling state, trivially initialized so that it is cheap to access on every allocation
+static thread_local std::uint64_t memstats_sample_random_state = 0;
+static thread_local std::ptrdiff_t memstats_sample_countdown = 0;
+
+// exponentially distributed distance in bytes to the next sampled allocation
+std::ptrdiff_t memstats_sample_distance()
+{
+    return std::ptrdiff_t(-std::log(memstats_random_unit(memstats_sample_random_state)) * double(memstats_sample_interval)) + 1;
+}
+
+/** Whether an allocation of 'sz' bytes has to be recorded.
+ * Bytes allocated by a thread are seen as a Poisson process where a sample is taken every 'memstats_sample_interval'
+ * bytes on average, so the allocation that crosses the next sampling point is recorded.
+ */
+bool memstats_do_sample(std::size_t sz)
+{
+    if (not memstats_sample_interval)
+        return true;
+    if (not memstats_sample_random_state)
+    {
+        // seed on first use with the (unique) address of the thread-local state
+        memstats_sample_random_state = std::uint64_t(reinterpret_cast<std::uintptr_t>(&memstats_sample_random_state)) | 1;
+        memstats_sample_countdown = memstats_sample_distance();
+    }
+    if ((memstats_sample_countdown -= std::ptrdiff_t(sz)) > 0)
+        return false;
+    memstats_sample_countdown = memstats_sample_distance();
+    return true;
+}
+
+void *memstats_aligned_malloc(std::size_t sz, std::size_t alignment)
+{
+#if MEMSTAT_PRELOAD
+    return __libc_memalign(std::max(alignment, sizeof(void *)), sz);
+#elif defined(_WIN32)
+    return _aligned_malloc(sz, alignment);
+#else
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, std::max(alignment, sizeof(void *)), sz) != 0)
+        return nullptr;
+    return ptr;
+#endif
+}
+
+void memstats_aligned_free(void *ptr)
+{
+#if defined(_WIN32) && !MEMSTAT_PRELOAD
+    _aligned_free(ptr);
+#else
+    memstats_raw_free(ptr);
+#endif
+}
+
+// allocation shared by all the replaced 'new' operators, 'alignment' is 0 for the default alignment
+MEMSTATS_NOINLINE void *memstats_new(std::size_t sz, std::size_t alignment)
 {
     if (sz == 0)
         sz = 1;
+    if (memstats_noalloc_depth and not memstats_thread_busy)
+        memstats_noalloc_violation(sz);
+    // every instrumented allocation is counted, but only the sampled ones are recorded
+    const bool counted = memstats_do_instrument();
+    const bool instrument = counted and memstats_do_sample(sz);
+    const std::int64_t time = instrument ? memstats_now() : 0;
     void *ptr;
-    while ((ptr = std::malloc(sz)) == nullptr)
+    while ((ptr = alignment ? memstats_aligned_malloc(sz, alignment) : memstats_raw_malloc(sz)) == nullptr)
     {
         std::new_handler handler = std::get_new_handler();
         if (handler)
@@ -455,17 +4525,20 @@ void *operator new(std::size_t sz)
         else
             throw std::bad_alloc{};
     }
-    if (memstats_do_instrument())
-        MemStatsInfo::record(ptr, sz);
+    // the latency only covers 'malloc', not the bookkeeping that follows
+    const std::uint64_t latency = instrument and memstats_latency ? std::uint64_t(memstats_now() - time) : 0;
+    if (counted)
+        memstats_own_counters().allocation(sz);
+    if (instrument)
+        MemStatsInfo::record(ptr, sz, MemStatsOperation::allocation, alignment, time, memstats_latency, latency);
     return ptr;
 }
 
-// instrumentation of new
-void *operator new(std::size_t sz, std::nothrow_t) noexcept
+void *memstats_new_nothrow(std::size_t sz, std::size_t alignment) noexcept
 {
     try
     {
-        return ::operator new(sz);
+        return memstats_new(sz, alignment);
     }
     catch (...)
     {
@@ -473,22 +4546,299 @@ void *operator new(std::size_t sz, std::nothrow_t) noexcept
     return nullptr;
 }
 
-// instrumentation of delete
-void operator delete(void *ptr) noexcept
+// deallocation shared by all the replaced 'delete' operators, 'sz' is 0 when it is not a sized deallocation
+MEMSTATS_NOINLINE void memstats_delete(void *ptr, std::size_t sz, std::size_t alignment) noexcept
+{
+    // live blocks are erased regardless of the instrumentation of this thread, before 'ptr' can be reused
+    MemStatsLiveBlock block;
+    const std::size_t freed = memstats_track_live ? memstats_erase_live(ptr, block) : 0;
+    // deallocations do not contribute to sampled statistics, but traces and lifetimes need the ones of live blocks
+    const bool counted = memstats_do_instrument();
+    const bool instrument = (counted and not memstats_sample_interval) or memstats_record_free_of_live(freed);
+    // the event is timestamped before 'ptr' can be reused, so that traces keep the order of the events on the same block
+    const std::int64_t time = instrument ? memstats_now() : 0;
+    if (alignment)
+        memstats_aligned_free(ptr);
+    else
+        memstats_raw_free(ptr);
+    // the latency only covers 'free', not the bookkeeping that follows
+    const std::uint64_t latency = instrument and memstats_latency ? std::uint64_t(memstats_now() - time) : 0;
+    if (counted and ptr)
+        memstats_own_counters().deallocation(sz ? sz : freed);
+    if (instrument)
+        MemStatsInfo::record(ptr, sz ? sz : freed, MemStatsOperation::deallocation, alignment, time, memstats_latency, latency, freed ? &block : nullptr);
+}
+
+#if !MEMSTAT_ANALYZE
+// instrumentation of new
+MEMSTATS_EXPORT void *operator new(std::size_t sz)
+{
+    return memstats_new(sz, 0);
+}
+
+MEMSTATS_EXPORT void *operator new[](std::size_t sz)
+{
+    return memstats_new(sz, 0);
+}
+
+MEMSTATS_EXPORT void *operator new(std::size_t sz, const std::nothrow_t &) noexcept
+{
+    return memstats_new_nothrow(sz, 0);
+}
+
+MEMSTATS_EXPORT void *operator new[](std::size_t sz, const std::nothrow_t &) noexcept
+{
+    return memstats_new_nothrow(sz, 0);
+}
+
+#if __cpp_aligned_new >= 201606L
+MEMSTATS_EXPORT void *operator new(std::size_t sz, std::align_val_t al)
+{
+    return memstats_new(sz, static_cast<std::size_t>(al));
+}
+
+MEMSTATS_EXPORT void *operator new[](std::size_t sz, std::align_val_t al)
+{
+    return memstats_new(sz, static_cast<std::size_t>(al));
+}
+
+MEMSTATS_EXPORT void *operator new(std::size_t sz, std::align_val_t al, const std::nothrow_t &) noexcept
 {
-    if (memstats_do_instrument())
-        MemStatsInfo::record(ptr);
-    std::free(ptr);
+    return memstats_new_nothrow(sz, static_cast<std::size_t>(al));
 }
 
+MEMSTATS_EXPORT void *operator new[](std::size_t sz, std::align_val_t al, const std::nothrow_t &) noexcept
+{
+    return memstats_new_nothrow(sz, static_cast<std::size_t>(al));
+}
+#endif
+
 // instrumentation of delete
-void operator delete(void *ptr, std::nothrow_t) noexcept
+MEMSTATS_EXPORT void operator delete(void *ptr) noexcept
 {
-    try
+    memstats_delete(ptr, 0, 0);
+}
+
+MEMSTATS_EXPORT void operator delete[](void *ptr) noexcept
+{
+    memstats_delete(ptr, 0, 0);
+}
+
+MEMSTATS_EXPORT void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    memstats_delete(ptr, 0, 0);
+}
+
+MEMSTATS_EXPORT void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    memstats_delete(ptr, 0, 0);
+}
+
+#if __cpp_sized_deallocation >= 201309L
+MEMSTATS_EXPORT void operator delete(void *ptr, std::size_t sz) noexcept
+{
+    memstats_delete(ptr, sz, 0);
+}
+
+MEMSTATS_EXPORT void operator delete[](void *ptr, std::size_t sz) noexcept
+{
+    memstats_delete(ptr, sz, 0);
+}
+#endif
+
+#if __cpp_aligned_new >= 201606L
+MEMSTATS_EXPORT void operator delete(void *ptr, std::align_val_t al) noexcept
+{
+    memstats_delete(ptr, 0, static_cast<std::size_t>(al));
+}
+
+MEMSTATS_EXPORT void operator delete[](void *ptr, std::align_val_t al) noexcept
+{
+    memstats_delete(ptr, 0, static_cast<std::size_t>(al));
+}
+
+MEMSTATS_EXPORT void operator delete(void *ptr, std::size_t sz, std::align_val_t al) noexcept
+{
+    memstats_delete(ptr, sz, static_cast<std::size_t>(al));
+}
+
+MEMSTATS_EXPORT void operator delete[](void *ptr, std::size_t sz, std::align_val_t al) noexcept
+{
+    memstats_delete(ptr, sz, static_cast<std::size_t>(al));
+}
+
+MEMSTATS_EXPORT void operator delete(void *ptr, std::align_val_t al, const std::nothrow_t &) noexcept
+{
+    memstats_delete(ptr, 0, static_cast<std::size_t>(al));
+}
+
+MEMSTATS_EXPORT void operator delete[](void *ptr, std::align_val_t al, const std::nothrow_t &) noexcept
+{
+    memstats_delete(ptr, 0, static_cast<std::size_t>(al));
+}
+#endif
+
+#endif
+
+#if MEMSTAT_PRELOAD
+// instrumentation of the C allocation functions, only when built as a preloaded shared library
+
+MEMSTATS_NOINLINE void memstats_record_malloc(void *ptr, std::size_t sz, std::size_t alignment)
+{
+    if (memstats_noalloc_depth and not memstats_thread_busy)
+        memstats_noalloc_violation(sz);
+    if (not ptr or not memstats_do_instrument())
+        return;
+    memstats_own_counters().allocation(sz);
+    if (memstats_do_sample(sz))
+        MemStatsInfo::record(ptr, sz, MemStatsOperation::allocation, alignment, memstats_now());
+}
+
+// takes 'ptr' out of the live blocks into 'block' before it can be reused by other threads, returns the freed bytes if it was live
+std::size_t memstats_take_live(void *ptr, MemStatsLiveBlock &block)
+{
+    return memstats_track_live and not memstats_thread_busy ? memstats_erase_live(ptr, block) : 0;
+}
+
+// timestamp of the deallocation of a block of 'freed' bytes, only taken if it may be recorded
+std::int64_t memstats_free_time(std::size_t freed)
+{
+    return freed or memstats_do_instrument() ? memstats_now() : 0;
+}
+
+// deallocation of 'ptr' at 'time', 'block' is the live block taken out by 'memstats_take_live' if 'freed' is not 0
+MEMSTATS_NOINLINE void memstats_record_free(void *ptr, std::size_t freed, const MemStatsLiveBlock &block, std::int64_t time)
+{
+    if (not ptr)
+        return;
+    const bool counted = memstats_do_instrument();
+    if (counted)
+        memstats_own_counters().deallocation(freed);
+    if ((counted and not memstats_sample_interval) or memstats_record_free_of_live(freed))
+        MemStatsInfo::record(ptr, freed, MemStatsOperation::deallocation, 0, time, false, 0, freed ? &block : nullptr);
+}
+
+/** Reallocation of 'ptr' to 'sz' bytes, recorded as the deallocation of the old block and the allocation of the new one.
+ * Always inlined into the functions calling it, so that their caller is right above the frame recording the events,
+ * as for any other interposed function.
+ */
+__attribute__((always_inline)) inline void *memstats_realloc(void *ptr, std::size_t sz)
+{
+    // the old block has to be released (and its deallocation timestamped) before it can be reused by other threads
+    MemStatsLiveBlock block;
+    const std::size_t freed = memstats_take_live(ptr, block);
+    const std::int64_t time = memstats_free_time(freed);
+    void *new_ptr = __libc_realloc(ptr, sz);
+    if (not new_ptr and sz)
     {
-        return ::operator delete(ptr);
+        // the old block is left untouched
+        if (freed)
+            memstats_restore_live(block);
+        memstats_record_malloc(nullptr, sz, 0);
+        return nullptr;
     }
-    catch (...)
+    memstats_record_free(ptr, freed, block, time);
+    memstats_record_malloc(new_ptr, sz, 0);
+    return new_ptr;
+}
+
+// allocation of 'sz' bytes aligned to 'alignment', always inlined as 'memstats_realloc'
+__attribute__((always_inline)) inline void *memstats_memalign(std::size_t alignment, std::size_t sz)
+{
+    void *ptr = __libc_memalign(alignment, sz);
+    memstats_record_malloc(ptr, sz, alignment);
+    return ptr;
+}
+
+// computes 'n * sz' into 'bytes', returns false if it overflows
+inline bool memstats_multiply(std::size_t n, std::size_t sz, std::size_t &bytes)
+{
+    if (sz and n > std::numeric_limits<std::size_t>::max() / sz)
+        return false;
+    bytes = n * sz;
+    return true;
+}
+
+extern "C"
+{
+MEMSTATS_EXPORT void *malloc(std::size_t sz)
+{
+    void *ptr = __libc_malloc(sz);
+    memstats_record_malloc(ptr, sz, 0);
+    return ptr;
+}
+
+MEMSTATS_EXPORT void *calloc(std::size_t n, std::size_t sz)
+{
+    void *ptr = __libc_calloc(n, sz);
+    // a successful 'calloc' implies that 'n * sz' does not overflow
+    std::size_t bytes;
+    if (ptr and memstats_multiply(n, sz, bytes))
+        memstats_record_malloc(ptr, bytes, 0);
+    return ptr;
+}
+
+MEMSTATS_EXPORT void *realloc(void *ptr, std::size_t sz)
+{
+    return memstats_realloc(ptr, sz);
+}
+
+MEMSTATS_EXPORT void *reallocarray(void *ptr, std::size_t n, std::size_t sz)
+{
+    std::size_t bytes;
+    if (not memstats_multiply(n, sz, bytes))
+    {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    return memstats_realloc(ptr, bytes);
+}
+
+MEMSTATS_EXPORT void free(void *ptr)
+{
+    MemStatsLiveBlock block;
+    const std::size_t freed = memstats_take_live(ptr, block);
+    memstats_record_free(ptr, freed, block, memstats_free_time(freed));
+    __libc_free(ptr);
+}
+
+MEMSTATS_EXPORT void *memalign(std::size_t alignment, std::size_t sz)
+{
+    return memstats_memalign(alignment, sz);
+}
+
+MEMSTATS_EXPORT void *aligned_alloc(std::size_t alignment, std::size_t sz)
+{
+    return memstats_memalign(alignment, sz);
+}
+
+MEMSTATS_EXPORT int posix_memalign(void **ptr, std::size_t alignment, std::size_t sz)
+{
+    if (alignment < sizeof(void *) or (alignment & (alignment - 1)))
+        return EINVAL;
+    void *new_ptr = __libc_memalign(alignment, sz);
+    if (not new_ptr)
+        return ENOMEM;
+    memstats_record_malloc(new_ptr, sz, alignment);
+    *ptr = new_ptr;
+    return 0;
+}
+
+MEMSTATS_EXPORT void *valloc(std::size_t sz)
+{
+    return memstats_memalign(sysconf(_SC_PAGESIZE), sz);
+}
+
+MEMSTATS_EXPORT void *pvalloc(std::size_t sz)
+{
+    // rounded up to whole pages, at least one
+    const std::size_t page = sysconf(_SC_PAGESIZE);
+    if (sz > std::numeric_limits<std::size_t>::max() - page)
     {
+        errno = ENOMEM;
+        return nullptr;
     }
+    return memstats_memalign(page, sz ? (sz + page - 1) & ~(page - 1) : page);
 }
+}
+#endif
@@ -1,19 +1,44 @@
 #ifndef MEMSTATS_HH
 #define MEMSTATS_HH
 
+#include <stddef.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MEMSTATS_DEPRECATED(message) __attribute__((deprecated(message)))
+#elif defined(_MSC_VER)
+#define MEMSTATS_DEPRECATED(message) __declspec(deprecated(message))
+#else
+#define MEMSTATS_DEPRECATED(message)
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /** @brief Reports on instrumented statistics and flushes instrumented data.
  * @details Only performs report if any instrumentation has been collected.
- * Do not call when other threads may call 'new' and 'delete', i.e., make
- * sure to syncronize all threads before and after calling report.
+ * Thread-safe: other threads may keep calling 'new' and 'delete' meanwhile.
+ * The buffers of each thread are taken as a whole, and the thread continues on
+ * new ones, so the report covers every event recorded up to the call.
  * Do not call during static- or dynamic-initialization phase.
  * Reporting from a detached thread is undefined behavior.
  */
 void memstats_report(const char * report_name = "");
 
+/** @brief Same as 'memstats_report'.
+ * @deprecated Reports are thread-safe, call 'memstats_report' instead.
+ */
+MEMSTATS_DEPRECATED("call 'memstats_report' instead")
+void memstats_snapshot(const char * report_name = "");
+
+/** @brief Reports on the events of a trace file written by an instrumented program.
+ * @details Prints a report for each report made by the traced program, followed by
+ * a report named 'trace' with the events written after the last one.
+ * Traces are written when the 'MEMSTATS_TRACE_FILE' environment variable is set.
+ * @return Whether the trace file could be read
+ */
+bool memstats_report_trace(const char * trace_path);
+
 /** @brief Enable instrumentation of 'new' and 'delete' for the calling thread.
  * @details Thread-local. Do not call during static- or dynamic-initialization phase.
  * @return Whether instrumentation was enabled before to this call
@@ -26,8 +51,83 @@ bool memstats_enable_thread_instrumentation();
  */
 bool memstats_disable_thread_instrumentation();
 
+/** @brief Opens a named region on the calling thread.
+ * @details Thread-local. Allocations until the matching 'memstats_region_end' are
+ * attributed to the region, and to the regions enclosing it, on the next reports.
+ * Regions opened while another one is open are nested in it. The name is copied.
+ */
+void memstats_region_begin(const char * name);
+
+/** @brief Closes the innermost region opened on the calling thread.
+ * @details Thread-local. Does nothing if no region is open.
+ */
+void memstats_region_end();
+
+/** @brief Opens a scope on the calling thread where no allocation is expected.
+ * @details Thread-local. Allocations by the calling thread until the matching
+ * 'memstats_noalloc_end' are counted against the scope, whether instrumentation
+ * is enabled or not. Depending on 'MEMSTATS_NOALLOC', each of them either aborts
+ * the program with its stacktrace or is logged for the next report. The name is
+ * not copied and must stay valid until then, e.g., a string literal.
+ */
+void memstats_noalloc_begin(const char * name);
+
+/** @brief Closes the innermost no-alloc scope opened on the calling thread.
+ * @details Thread-local.
+ * @return Number of allocations made within the scope, including nested scopes
+ */
+size_t memstats_noalloc_end();
+
+/** @brief Allocation counters of one thread, see 'memstats_thread_counters'. */
+typedef struct memstats_counters
+{
+    /** Hash of the 'std::thread::id' of the thread, 0 for the threads that finished */
+    size_t thread;
+    unsigned long long allocations;
+    unsigned long long deallocations;
+    unsigned long long allocated_bytes;
+    /** Only known for sized deallocations or when tracking the live heap */
+    unsigned long long deallocated_bytes;
+    /** Allocations per power of two of their size, 'i' counts sizes in [2^i, 2^(i+1)) */
+    unsigned long long size_classes[64];
+} memstats_counters;
+
+/** @brief Calls 'callback' with the counters of each thread that allocated.
+ * @details Thread-safe and lock-free, so it can be polled from a monitoring
+ * thread while other threads keep allocating. Counters include every
+ * instrumented 'new' and 'delete', also when sampling, and are never reset:
+ * rates are the differences between two polls. The final counters of the
+ * threads that finished are summed up and visited once, with 'thread' 0.
+ * The counters are only valid during the callback.
+ */
+void memstats_thread_counters(void (*callback)(const memstats_counters * counters, void * data), void * data);
+
 #ifdef __cplusplus
 }
+
+/** @brief Region opened on construction and closed on destruction.
+ * @details See 'memstats_region_begin'.
+ */
+class MemStatsRegion
+{
+public:
+    explicit MemStatsRegion(const char * name) { memstats_region_begin(name); }
+    ~MemStatsRegion() { memstats_region_end(); }
+    MemStatsRegion(const MemStatsRegion &) = delete;
+    MemStatsRegion & operator=(const MemStatsRegion &) = delete;
+};
+
+/** @brief No-alloc scope opened on construction and closed on destruction.
+ * @details See 'memstats_noalloc_begin'.
+ */
+class MemStatsNoAlloc
+{
+public:
+    explicit MemStatsNoAlloc(const char * name) { memstats_noalloc_begin(name); }
+    ~MemStatsNoAlloc() { memstats_noalloc_end(); }
+    MemStatsNoAlloc(const MemStatsNoAlloc &) = delete;
+    MemStatsNoAlloc & operator=(const MemStatsNoAlloc &) = delete;
+};
 #endif
 
 #endif // MEMSTATS_HH
@@ -0,0 +1,14 @@
+#include "memstats.hh"
+
+#include <iostream>
+
+// Prints the reports of a trace file written by a program run with 'MEMSTATS_TRACE_FILE'
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <trace file>\n";
+        return 1;
+    }
+    return memstats_report_trace(argv[1]) ? 0 : 1;
+}